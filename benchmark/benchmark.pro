@@ -0,0 +1,13 @@
+TEMPLATE = app
+TARGET = emacskeysbench
+
+# Drives EmacsKeysHandler on a plain QPlainTextEdit, no Qt Creator needed.
+# Built by ../emacskeys.pro with CONFIG+=emacskeys_benchmark.
+# Run headless with QT_QPA_PLATFORM=offscreen (Qt 5) or under Xvfb (Qt 4).
+CONFIG += console
+CONFIG -= app_bundle
+
+EMACSKEYSCORE_LIBDIR = $$OUT_PWD/../core
+include(../emacskeyscore.pri)
+
+SOURCES += main.cpp
@@ -0,0 +1,390 @@
+/**************************************************************************
+**
+** GNU Lesser General Public License Usage
+**
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** If you are unsure which license is appropriate for your use, please
+** contact the sales department at http://www.qtsoftware.com/contact.
+**
+**************************************************************************/
+
+// Key replay benchmark for EmacsKeysHandler.
+//
+// Generates documents of the requested sizes, replays scripted key streams
+// through the handler's event filter exactly like Qt delivers them
+// (ShortcutOverride, then KeyPress) and reports keys/sec and p50/p99
+// latency per script. A key that leaves an isearch scan running is timed
+// until the scan settles, the event loop runs the scan's slices meanwhile.
+//
+//   emacskeysbench [--lines 1000,10000,100000,1000000] [--keys 2000]
+//                  [--script name=keys] [--csv]
+//   emacskeysbench --shared-ring processes [--keys adds]
+//
+// Scripts are written in emacs notation, e.g. "C-n C-n M-f C-u C-SPC".
+//
+// --shared-ring starts that many copies of itself, which add entries to
+// one shared kill ring concurrently, and checks the result.
+
+#include "emacskeyshandler.h"
+#include "killring.h"
+#include "sharedkillring.h"
+
+#include <QApplication>
+#include <QElapsedTimer>
+#include <QKeyEvent>
+#include <QPlainTextEdit>
+#include <QProcess>
+#include <QSet>
+#include <QStringList>
+#include <QTextCursor>
+#include <QTextStream>
+#include <QVector>
+
+#include <stdio.h>
+
+using namespace EmacsKeys::Internal;
+
+namespace {
+
+struct Key
+{
+    Key() : key(0), modifiers(Qt::NoModifier) {}
+    Key(int key, Qt::KeyboardModifiers modifiers, const QString &text)
+        : key(key), modifiers(modifiers), text(text) {}
+    int key;
+    Qt::KeyboardModifiers modifiers;
+    QString text;
+};
+
+struct Script
+{
+    QString name;
+    QVector<Key> keys;
+};
+
+struct Result
+{
+    int keys;
+    double keysPerSecond;
+    double p50;
+    double p99;
+};
+
+// Parses "C-n", "M-<", "C-SPC", "DEL", "a" ... into key events.
+bool parseKey(const QString &token, Key *result)
+{
+    Qt::KeyboardModifiers modifiers = Qt::NoModifier;
+    QString name = token;
+    while (name.size() > 2 && name.at(1) == QLatin1Char('-')) {
+        const QChar prefix = name.at(0);
+        if (prefix == QLatin1Char('C'))
+            modifiers |= Qt::ControlModifier;
+        else if (prefix == QLatin1Char('M'))
+            modifiers |= Qt::AltModifier;
+        else if (prefix == QLatin1Char('S'))
+            modifiers |= Qt::ShiftModifier;
+        else
+            return false;
+        name = name.mid(2);
+    }
+
+    int key = 0;
+    QString text;
+    if (name == QLatin1String("SPC")) {
+        key = Qt::Key_Space;
+        text = QLatin1String(" ");
+    } else if (name == QLatin1String("DEL")) {
+        key = Qt::Key_Backspace;
+    } else if (name == QLatin1String("RET")) {
+        key = Qt::Key_Return;
+        text = QLatin1String("\r");
+    } else if (name == QLatin1String("TAB")) {
+        key = Qt::Key_Tab;
+        text = QLatin1String("\t");
+    } else if (name.size() == 1) {
+        const QChar c = name.at(0);
+        text = name;
+        if (c.isLetter()) {
+            key = Qt::Key_A + c.toLower().unicode() - 'a';
+            if (c.isUpper())
+                modifiers |= Qt::ShiftModifier;
+        } else {
+            key = c.unicode();
+            // shifted on a US keyboard, that's how the bindings are written
+            if (c == QLatin1Char('<') || c == QLatin1Char('>') || c == QLatin1Char('@')
+                    || c == QLatin1Char('(') || c == QLatin1Char(')'))
+                modifiers |= Qt::ShiftModifier;
+        }
+    } else {
+        return false;
+    }
+    if (modifiers & (Qt::ControlModifier | Qt::AltModifier))
+        text.clear();
+    *result = Key(key, modifiers, text);
+    return true;
+}
+
+bool parseScript(const QString &name, const QString &keys, Script *script)
+{
+    script->name = name;
+    script->keys.clear();
+    foreach (const QString &token, keys.split(QLatin1Char(' '), QString::SkipEmptyParts)) {
+        Key key;
+        if (!parseKey(token, &key)) {
+            fprintf(stderr, "Cannot parse key '%s' in script %s\n",
+                qPrintable(token), qPrintable(name));
+            return false;
+        }
+        script->keys.append(key);
+    }
+    return !script->keys.isEmpty();
+}
+
+QList<Script> defaultScripts()
+{
+    static const char * const scripts[][2] = {
+        { "movement", "C-n C-n C-f C-f M-f M-f C-e C-a C-p C-n M-b C-b C-n" },
+        { "paging", "M-v M-v M-v C-v M-v C-v C-v" },
+        { "kill-yank", "C-n C-a C-k C-k C-y C-n M-d C-y C-n C-DEL C-y" },
+        { "mark", "C-SPC C-n C-n C-e M-w C-n C-u C-SPC C-x C-x C-g C-n" },
+        { "whitespace", "C-n C-a M-f M-SPC C-e M-SPC C-n" },
+        // kills the first four columns of every line and yanks them back
+        { "rectangle", "M-< C-SPC M-> C-p C-f C-f C-f C-f C-x r k C-x r y" },
+        { "isearch", "C-s m a r k e r C-s C-s DEL DEL RET C-r d a t a C-r RET" },
+        { "isearch-regexp", "C-M-s v a l u e _ 9 9 . * m a r k e r C-s DEL DEL RET C-M-r d a t a $ C-r RET" }
+    };
+    QList<Script> result;
+    for (size_t i = 0; i < sizeof(scripts) / sizeof(scripts[0]); ++i) {
+        Script script;
+        if (parseScript(QLatin1String(scripts[i][0]), QLatin1String(scripts[i][1]), &script))
+            result.append(script);
+    }
+    return result;
+}
+
+QString generateDocument(int lines)
+{
+    QString text;
+    text.reserve(lines * 48);
+    for (int i = 0; i < lines; ++i) {
+        text += QString::fromLatin1("    int value_%1  =  compute(%1, \"token\");   // %2\n")
+            .arg(i).arg(i % 7 ? QLatin1String("data") : QLatin1String("marker"));
+    }
+    return text;
+}
+
+double percentile(const QVector<qint64> &sorted, double p)
+{
+    if (sorted.isEmpty())
+        return 0;
+    const int index = qMin(sorted.size() - 1, int(sorted.size() * p));
+    return sorted.at(index) / 1000.0;
+}
+
+Result replay(QPlainTextEdit *editor, EmacsKeysHandler *handler, const Script &script,
+    int keyCount)
+{
+    QVector<qint64> latencies;
+    latencies.reserve(keyCount);
+
+    QElapsedTimer total;
+    QElapsedTimer timer;
+    total.start();
+    for (int i = 0; i < keyCount; ++i) {
+        const Key &key = script.keys.at(i % script.keys.size());
+        QKeyEvent shortcutOverride(QEvent::ShortcutOverride, key.key, key.modifiers, key.text);
+        QKeyEvent keyPress(QEvent::KeyPress, key.key, key.modifiers, key.text);
+        shortcutOverride.ignore();
+        timer.start();
+        QApplication::sendEvent(editor, &shortcutOverride);
+        QApplication::sendEvent(editor, &keyPress);
+        while (handler->searchResult() == EmacsKeysHandler::SearchRunning)
+            QCoreApplication::processEvents();
+        latencies.append(timer.nsecsElapsed());
+    }
+    const qint64 elapsed = qMax(total.nsecsElapsed(), qint64(1));
+
+    qSort(latencies.begin(), latencies.end());
+    Result result;
+    result.keys = keyCount;
+    result.keysPerSecond = keyCount * 1e9 / elapsed;
+    result.p50 = percentile(latencies, 0.50);
+    result.p99 = percentile(latencies, 0.99);
+    return result;
+}
+
+void usage()
+{
+    fprintf(stderr, "Usage: emacskeysbench [--lines n,n,...] [--keys n] "
+        "[--script name=keys] [--csv]\n"
+        "       emacskeysbench --shared-ring processes [--keys n]\n");
+}
+
+QString sharedEntry(int process, int entry)
+{
+    return QString::fromLatin1("process %1 entry %2").arg(process).arg(entry);
+}
+
+// One writer of the shared ring test: adds entries through KillRing and
+// yanks in between, so reads race with the other writers.
+int sharedRingChild(const QString &key, int process, int adds)
+{
+    KillRing *killRing = KillRing::instance();
+    if (!killRing->setSharedKey(key))
+        return 1;
+    for (int i = 0; i < adds; ++i) {
+        killRing->add(sharedEntry(process, i));
+        if (i % 8 == 0)
+            killRing->next();
+    }
+    return 0;
+}
+
+int sharedRingTest(int processes, int adds)
+{
+    const QString key = QString::fromLatin1("emacskeysbench-%1")
+        .arg(QCoreApplication::applicationPid());
+    // keeps the segment alive while the writers come and go
+    SharedKillRing ring;
+    if (!ring.attach(key)) {
+        fprintf(stderr, "Cannot create shared memory %s\n", qPrintable(key));
+        return 1;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    QList<QProcess *> children;
+    for (int i = 0; i < processes; ++i) {
+        QProcess *child = new QProcess;
+        child->setProcessChannelMode(QProcess::ForwardedChannels);
+        child->start(QCoreApplication::applicationFilePath(), QStringList()
+            << QLatin1String("--shared-ring-child") << key
+            << QString::number(i) << QString::number(adds));
+        children.append(child);
+    }
+    bool ok = true;
+    foreach (QProcess *child, children) {
+        if (!child->waitForFinished(-1) || child->exitCode() != 0)
+            ok = false;
+        delete child;
+    }
+    const qint64 elapsed = timer.elapsed();
+
+    // every process must see the newest entry of every writer, serials
+    // must come out strictly increasing
+    const QList<SharedKillRing::Item> items = ring.itemsSince(0);
+    QSet<QString> texts;
+    quint32 serial = 0;
+    foreach (const SharedKillRing::Item &item, items) {
+        if (item.serial <= serial)
+            ok = false;
+        serial = item.serial;
+        texts.insert(item.text);
+    }
+    for (int i = 0; i < processes; ++i) {
+        if (adds > 0 && !texts.contains(sharedEntry(i, adds - 1))) {
+            fprintf(stderr, "Newest entry of process %d is missing\n", i);
+            ok = false;
+        }
+    }
+    KillRing::instance()->setMaxEntries(SharedKillRing::MaxSlots);
+    KillRing::instance()->setSharedKey(key);
+    if (KillRing::instance()->count() != items.size())
+        ok = false;
+
+    printf("shared ring: %d processes x %d adds in %lld ms, %d entries, %s\n",
+        processes, adds, elapsed, items.size(), ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+} // anonymous namespace
+
+int main(int argc, char *argv[])
+{
+    QApplication app(argc, argv);
+
+    QList<int> sizes;
+    sizes << 1000 << 10000 << 100000 << 1000000;
+    int keyCount = 2000;
+    bool csv = false;
+    QList<Script> scripts;
+
+    const QStringList args = app.arguments();
+    if (args.size() == 5 && args.at(1) == QLatin1String("--shared-ring-child"))
+        return sharedRingChild(args.at(2), args.at(3).toInt(), args.at(4).toInt());
+    int sharedRingProcesses = 0;
+    for (int i = 1; i < args.size(); ++i) {
+        const QString &arg = args.at(i);
+        if (arg == QLatin1String("--lines") && i + 1 < args.size()) {
+            sizes.clear();
+            foreach (const QString &size, args.at(++i).split(QLatin1Char(',')))
+                sizes.append(size.toInt());
+        } else if (arg == QLatin1String("--keys") && i + 1 < args.size()) {
+            keyCount = args.at(++i).toInt();
+        } else if (arg == QLatin1String("--script") && i + 1 < args.size()) {
+            const QString spec = args.at(++i);
+            const int eq = spec.indexOf(QLatin1Char('='));
+            Script script;
+            if (eq <= 0 || !parseScript(spec.left(eq), spec.mid(eq + 1), &script))
+                return 1;
+            scripts.append(script);
+        } else if (arg == QLatin1String("--csv")) {
+            csv = true;
+        } else if (arg == QLatin1String("--shared-ring") && i + 1 < args.size()) {
+            sharedRingProcesses = args.at(++i).toInt();
+        } else {
+            usage();
+            return 1;
+        }
+    }
+    if (sharedRingProcesses > 0)
+        return sharedRingTest(sharedRingProcesses, keyCount);
+    if (scripts.isEmpty())
+        scripts = defaultScripts();
+
+    QTextStream out(stdout);
+    if (csv)
+        out << "lines,script,keys,keys_per_sec,p50_us,p99_us\n";
+    else
+        out << QString::fromLatin1("%1 %2 %3 %4 %5 %6\n")
+            .arg(QLatin1String("lines"), 8).arg(QLatin1String("script"), -12)
+            .arg(QLatin1String("keys"), 7).arg(QLatin1String("keys/sec"), 11)
+            .arg(QLatin1String("p50 us"), 9).arg(QLatin1String("p99 us"), 9);
+
+    foreach (int lines, sizes) {
+        QPlainTextEdit editor;
+        editor.resize(800, 600);
+        editor.setPlainText(generateDocument(lines));
+
+        EmacsKeysHandler handler(&editor);
+        handler.setActive(true);
+        handler.setupWidget();
+        handler.installEventFilter();
+
+        foreach (const Script &script, scripts) {
+            // every script starts from the middle of the document
+            QTextCursor tc = editor.textCursor();
+            tc.setPosition(editor.document()->findBlockByNumber(lines / 2).position());
+            editor.setTextCursor(tc);
+
+            const Result result = replay(&editor, &handler, script, keyCount);
+            if (csv) {
+                out << lines << ',' << script.name << ',' << result.keys << ','
+                    << result.keysPerSecond << ',' << result.p50 << ',' << result.p99 << '\n';
+            } else {
+                out << QString::fromLatin1("%1 %2 %3 %4 %5 %6\n")
+                    .arg(lines, 8).arg(script.name, -12).arg(result.keys, 7)
+                    .arg(result.keysPerSecond, 11, 'f', 0)
+                    .arg(result.p50, 9, 'f', 1).arg(result.p99, 9, 'f', 1);
+            }
+            out.flush();
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,49 @@
+TEMPLATE = lib
+TARGET = EmacsKeysCore
+
+# Static library of the key handling engine: EmacsKeysHandler and its rings,
+# no Qt Creator dependencies. The plugin and the benchmark link it through
+# emacskeyscore.pri, other Qt tools can too: wrap any QTextEdit or
+# QPlainTextEdit with EmacsKeys::Internal::EmacsKeysHandler.
+CONFIG += staticlib
+DESTDIR = $$OUT_PWD
+# linked into the plugin, a shared library
+unix: QMAKE_CXXFLAGS += $$QMAKE_CXXFLAGS_SHLIB
+
+QT += gui
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
+
+SRC = $$PWD/..
+INCLUDEPATH += $$SRC
+DEPENDPATH += $$SRC
+
+SOURCES += \
+    $$SRC/documentstate.cpp \
+    $$SRC/editoradapter.cpp \
+    $$SRC/emacskeyshandler.cpp \
+    $$SRC/globalmarkring.cpp \
+    $$SRC/incrementalsearch.cpp \
+    $$SRC/killring.cpp \
+    $$SRC/killringbrowser.cpp \
+    $$SRC/killringstore.cpp \
+    $$SRC/latencystats.cpp \
+    $$SRC/markring.cpp \
+    $$SRC/positiontracker.cpp \
+    $$SRC/registers.cpp \
+    $$SRC/sharedkillring.cpp
+
+HEADERS += \
+    $$SRC/documentstate.h \
+    $$SRC/editoradapter.h \
+    $$SRC/emacskeyshandler.h \
+    $$SRC/globalmarkring.h \
+    $$SRC/incrementalsearch.h \
+    $$SRC/killring.h \
+    $$SRC/killringbrowser.h \
+    $$SRC/killringstore.h \
+    $$SRC/latencystats.h \
+    $$SRC/mark.h \
+    $$SRC/markring.h \
+    $$SRC/positiontracker.h \
+    $$SRC/registers.h \
+    $$SRC/sharedkillring.h
@@ -0,0 +1,81 @@
+#include "documentstate.h"
+#include "globalmarkring.h"
+#include "registers.h"
+
+#include <QTextBlock>
+
+QHash<QTextDocument*, DocumentState*> DocumentState::states;
+
+DocumentState::DocumentState(QTextDocument* document)
+  : yankStartPosition(0), yankEndPosition(0), yankPreviewOwner(0), doc(document),
+    refCount(0)
+{
+  positions.setDocument(document);
+  markRing.setPositions(&positions);
+}
+
+DocumentState* DocumentState::acquire(QTextDocument* document)
+{
+  DocumentState*& state = states[document];
+  // a state left behind by a deleted document at the same address
+  // stays with the handlers that still hold it
+  if (state && !state->doc) {
+    state = 0;
+  }
+  if (!state) {
+    state = new DocumentState(document);
+  }
+  ++state->refCount;
+  return state;
+}
+
+void DocumentState::release(DocumentState* state)
+{
+  if (!state || --state->refCount > 0) {
+    return;
+  }
+  GlobalMarkRing::instance()->documentClosed(state);
+  Registers::instance()->documentClosed(state);
+  if (states.value(state->doc) == state) {
+    states.remove(state->doc);
+  } else {
+    // the document is gone, find the entry by value
+    QTextDocument* key = states.key(state, 0);
+    if (key) {
+      states.remove(key);
+    }
+  }
+  delete state;
+}
+
+QTextDocument* DocumentState::document() const
+{
+  return doc;
+}
+
+QString DocumentState::fileName() const
+{
+  return file;
+}
+
+void DocumentState::setFileName(const QString& fileName)
+{
+  file = fileName;
+}
+
+void DocumentState::close()
+{
+  GlobalMarkRing::instance()->documentClosed(this);
+  Registers::instance()->documentClosed(this);
+}
+
+void DocumentState::lineAndColumn(int position, int* line, int* column) const
+{
+  *line = 1;
+  *column = 0;
+  if (doc) {
+    const QTextBlock block = doc->findBlock(position);
+    *line = block.blockNumber() + 1;
+    *column = position - block.position();
+  }
+}
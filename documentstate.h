@@ -0,0 +1,53 @@
+#ifndef DOCUMENTSTATE_H
+#define DOCUMENTSTATE_H
+
+#include <QHash>
+#include <QPointer>
+#include <QTextDocument>
+
+#include "markring.h"
+#include "positiontracker.h"
+
+/* Editing state that belongs to a document rather than to a view: the
+ * mark ring, with the active region, and the range of the last yank.
+ * positions tracks all marks into the document, also those of the
+ * GlobalMarkRing and of position Registers.
+ * Handlers of all views on one document (split views) share a single
+ * DocumentState. acquire() counts the handlers, release() frees the state
+ * with the last one. */
+class DocumentState
+{
+public:
+  static DocumentState* acquire(QTextDocument* document);
+  static void release(DocumentState* state);
+
+  QTextDocument* document() const;
+  QString fileName() const;
+  // the file is where a global mark goes once the document is closed
+  void setFileName(const QString& fileName);
+  // line (1-based) and column (0-based) of position
+  void lineAndColumn(int position, int* line, int* column) const;
+  // the document is about to go: global marks and position registers
+  // into it become file name and line while its text is still there. Handlers are usually deleted
+  // after their document, so release() alone is too late for that.
+  void close();
+
+  PositionTracker positions;
+  MarkRing markRing;
+  int yankStartPosition;
+  int yankEndPosition;
+  // the handler showing a yank-pop preview of that range, 0 if none; a
+  // preview in another view of the document is dropped, not committed
+  QObject* yankPreviewOwner;
+
+private:
+  explicit DocumentState(QTextDocument* document);
+
+  QPointer<QTextDocument> doc;
+  QString file;
+  int refCount;
+
+  static QHash<QTextDocument*, DocumentState*> states;
+};
+
+#endif // DOCUMENTSTATE_H
@@ -0,0 +1,103 @@
+/**************************************************************************
+**
+** GNU Lesser General Public License Usage
+**
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** If you are unsure which license is appropriate for your use, please
+** contact the sales department at http://www.qtsoftware.com/contact.
+**
+**************************************************************************/
+
+#include "editoradapter.h"
+
+namespace EmacsKeys {
+namespace Internal {
+
+EditorAdapter::EditorAdapter(QWidget *widget, QWidget *viewport,
+        QScrollBar *verticalScrollBar)
+    : m_widget(widget), m_viewport(viewport), m_verticalScrollBar(verticalScrollBar),
+      m_plainTextEdit(0), m_textEdit(0)
+{}
+
+EditorAdapter::EditorAdapter(QPlainTextEdit *plainTextEdit)
+    : m_widget(plainTextEdit), m_viewport(plainTextEdit->viewport()),
+      m_verticalScrollBar(plainTextEdit->verticalScrollBar()),
+      m_plainTextEdit(plainTextEdit), m_textEdit(0)
+{}
+
+EditorAdapter::EditorAdapter(QTextEdit *textEdit)
+    : m_widget(textEdit), m_viewport(textEdit->viewport()),
+      m_verticalScrollBar(textEdit->verticalScrollBar()),
+      m_plainTextEdit(0), m_textEdit(textEdit)
+{}
+
+EditorAdapter::~EditorAdapter()
+{}
+
+EditorAdapter *EditorAdapter::create(QWidget *widget)
+{
+    if (QPlainTextEdit *plainTextEdit = qobject_cast<QPlainTextEdit *>(widget))
+        return new EditorAdapter(plainTextEdit);
+    if (QTextEdit *textEdit = qobject_cast<QTextEdit *>(widget))
+        return new EditorAdapter(textEdit);
+    return 0;
+}
+
+// Defaults for a subclass that does not support everything
+
+QTextDocument *EditorAdapter::editorDocument() const
+{
+    return 0;
+}
+
+QTextCursor EditorAdapter::editorTextCursor() const
+{
+    return QTextCursor();
+}
+
+void EditorAdapter::editorSetTextCursor(const QTextCursor &)
+{}
+
+QRect EditorAdapter::editorCursorRect(const QTextCursor &) const
+{
+    return QRect();
+}
+
+QTextCursor EditorAdapter::editorCursorForPosition(const QPoint &) const
+{
+    return QTextCursor();
+}
+
+int EditorAdapter::editorCursorWidth() const
+{
+    return 1;
+}
+
+void EditorAdapter::editorSetCursorWidth(int)
+{}
+
+bool EditorAdapter::editorIsReadOnly() const
+{
+    return false;
+}
+
+void EditorAdapter::editorSetReadOnly(bool)
+{}
+
+void EditorAdapter::editorSetOverwriteMode(bool)
+{}
+
+void EditorAdapter::editorSetLineWrapping(bool)
+{}
+
+void EditorAdapter::editorPaste()
+{}
+
+} // namespace Internal
+} // namespace EmacsKeys
@@ -0,0 +1,167 @@
+/**************************************************************************
+**
+** GNU Lesser General Public License Usage
+**
+** Alternatively, this file may be used under the terms of the GNU Lesser
+** General Public License version 2.1 as published by the Free Software
+** Foundation and appearing in the file LICENSE.LGPL included in the
+** packaging of this file.  Please review the following information to
+** ensure the GNU Lesser General Public License version 2.1 requirements
+** will be met: http://www.gnu.org/licenses/old-licenses/lgpl-2.1.html.
+**
+** If you are unsure which license is appropriate for your use, please
+** contact the sales department at http://www.qtsoftware.com/contact.
+**
+**************************************************************************/
+
+#ifndef EMACSKEYS_EDITORADAPTER_H
+#define EMACSKEYS_EDITORADAPTER_H
+
+#include <QPlainTextEdit>
+#include <QRect>
+#include <QTextCursor>
+#include <QTextEdit>
+
+class QScrollBar;
+
+namespace EmacsKeys {
+namespace Internal {
+
+// Everything EmacsKeysHandler needs from the editor widget. Widget, viewport
+// and scroll bar are resolved once, and so is a QTextEdit or QPlainTextEdit:
+// for those the calls below go straight to the widget without a virtual
+// call. Any other editor subclasses EditorAdapter and overrides the
+// protected editor...() functions, the only virtual dispatch left.
+class EditorAdapter
+{
+public:
+    // 0 unless widget is a QTextEdit or QPlainTextEdit
+    static EditorAdapter *create(QWidget *widget);
+    virtual ~EditorAdapter();
+
+    QWidget *widget() const { return m_widget; }
+    QWidget *viewport() const { return m_viewport; }
+    QScrollBar *verticalScrollBar() const { return m_verticalScrollBar; }
+
+    QTextDocument *document() const
+    {
+        return m_plainTextEdit ? m_plainTextEdit->document()
+                : m_textEdit ? m_textEdit->document() : editorDocument();
+    }
+    QTextCursor textCursor() const
+    {
+        return m_plainTextEdit ? m_plainTextEdit->textCursor()
+                : m_textEdit ? m_textEdit->textCursor() : editorTextCursor();
+    }
+    void setTextCursor(const QTextCursor &tc)
+    {
+        if (m_plainTextEdit)
+            m_plainTextEdit->setTextCursor(tc);
+        else if (m_textEdit)
+            m_textEdit->setTextCursor(tc);
+        else
+            editorSetTextCursor(tc);
+    }
+    QRect cursorRect() const
+    {
+        return m_plainTextEdit ? m_plainTextEdit->cursorRect()
+                : m_textEdit ? m_textEdit->cursorRect() : editorCursorRect(textCursor());
+    }
+    QRect cursorRect(const QTextCursor &tc) const
+    {
+        return m_plainTextEdit ? m_plainTextEdit->cursorRect(tc)
+                : m_textEdit ? m_textEdit->cursorRect(tc) : editorCursorRect(tc);
+    }
+    QTextCursor cursorForPosition(const QPoint &pos) const
+    {
+        return m_plainTextEdit ? m_plainTextEdit->cursorForPosition(pos)
+                : m_textEdit ? m_textEdit->cursorForPosition(pos) : editorCursorForPosition(pos);
+    }
+    int cursorWidth() const
+    {
+        return m_plainTextEdit ? m_plainTextEdit->cursorWidth()
+                : m_textEdit ? m_textEdit->cursorWidth() : editorCursorWidth();
+    }
+    void setCursorWidth(int width)
+    {
+        if (m_plainTextEdit)
+            m_plainTextEdit->setCursorWidth(width);
+        else if (m_textEdit)
+            m_textEdit->setCursorWidth(width);
+        else
+            editorSetCursorWidth(width);
+    }
+    bool isReadOnly() const
+    {
+        return m_plainTextEdit ? m_plainTextEdit->isReadOnly()
+                : m_textEdit ? m_textEdit->isReadOnly() : editorIsReadOnly();
+    }
+    void setReadOnly(bool on)
+    {
+        if (m_plainTextEdit)
+            m_plainTextEdit->setReadOnly(on);
+        else if (m_textEdit)
+            m_textEdit->setReadOnly(on);
+        else
+            editorSetReadOnly(on);
+    }
+    void setOverwriteMode(bool on)
+    {
+        if (m_plainTextEdit)
+            m_plainTextEdit->setOverwriteMode(on);
+        else if (m_textEdit)
+            m_textEdit->setOverwriteMode(on);
+        else
+            editorSetOverwriteMode(on);
+    }
+    void setLineWrapping(bool on)
+    {
+        if (m_plainTextEdit)
+            m_plainTextEdit->setLineWrapMode(on ? QPlainTextEdit::WidgetWidth : QPlainTextEdit::NoWrap);
+        else if (m_textEdit)
+            m_textEdit->setLineWrapMode(on ? QTextEdit::WidgetWidth : QTextEdit::NoWrap);
+        else
+            editorSetLineWrapping(on);
+    }
+    void paste()
+    {
+        if (m_plainTextEdit)
+            m_plainTextEdit->paste();
+        else if (m_textEdit)
+            m_textEdit->paste();
+        else
+            editorPaste();
+    }
+
+protected:
+    EditorAdapter(QWidget *widget, QWidget *viewport, QScrollBar *verticalScrollBar);
+
+    // Only called for editors that are neither QTextEdit nor QPlainTextEdit
+    virtual QTextDocument *editorDocument() const;
+    virtual QTextCursor editorTextCursor() const;
+    virtual void editorSetTextCursor(const QTextCursor &tc);
+    virtual QRect editorCursorRect(const QTextCursor &tc) const;
+    virtual QTextCursor editorCursorForPosition(const QPoint &pos) const;
+    virtual int editorCursorWidth() const;
+    virtual void editorSetCursorWidth(int width);
+    virtual bool editorIsReadOnly() const;
+    virtual void editorSetReadOnly(bool on);
+    virtual void editorSetOverwriteMode(bool on);
+    virtual void editorSetLineWrapping(bool on);
+    virtual void editorPaste();
+
+private:
+    explicit EditorAdapter(QPlainTextEdit *plainTextEdit);
+    explicit EditorAdapter(QTextEdit *textEdit);
+
+    QWidget *m_widget;
+    QWidget *m_viewport;
+    QScrollBar *m_verticalScrollBar;
+    QPlainTextEdit *m_plainTextEdit;
+    QTextEdit *m_textEdit;
+};
+
+} // namespace Internal
+} // namespace EmacsKeys
+
+#endif // EMACSKEYS_EDITORADAPTER_H
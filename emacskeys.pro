@@ -1,33 +1,16 @@
-TEMPLATE = lib
-TARGET = EmacsKeys
+TEMPLATE = subdirs
 
-# CONFIG += single
-include(../../qtcreatorplugin.pri)
-include(../../plugins/coreplugin/coreplugin.pri)
-include(../../plugins/texteditor/texteditor.pri)
-include(../../plugins/find/find.pri)
-include(../../plugins/projectexplorer/projectexplorer.pri)
+# core/core.pro builds the key handling engine as the static library
+# EmacsKeysCore, the plugin in emacskeysplugin.pro links it.
+# CONFIG+=emacskeys_benchmark builds the library and the benchmark
+# instead, without Qt Creator.
+SUBDIRS = core
 
-# DEFINES += QT_NO_CAST_FROM_ASCII QT_NO_CAST_TO_ASCII
-QT += gui
-
-SOURCES += \
-    emacskeysactions.cpp \
-    emacskeyshandler.cpp \
-    emacskeysplugin.cpp \
-    killring.cpp \
-    markring.cpp
-
-HEADERS += \
-    emacskeysactions.h \
-    emacskeyshandler.h \
-    emacskeysplugin.h \
-    mark.h \
-    markring.h \
-    killring.h 
-
-
-FORMS += \
-    emacskeysoptions.ui
-
-OTHER_FILES += EmacsKeys.pluginspec
+emacskeys_benchmark {
+    SUBDIRS += benchmark
+    benchmark.depends = core
+} else {
+    SUBDIRS += plugin
+    plugin.file = emacskeysplugin.pro
+    plugin.depends = core
+}
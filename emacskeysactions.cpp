@@ -108,6 +108,39 @@ EmacsKeysSettings *theEmacsKeysSettings()
     item->setCheckable(true);
     instance->insertItem(ConfigUseEmacsKeys, item);
 
+    item = new SavedAction(instance);
+    item->setDefaultValue(60);
+    item->setValue(60);
+    item->setSettingsKey(group, QLatin1String("KillRingMaxEntries"));
+    instance->insertItem(ConfigKillRingMaxEntries, item);
+
+    item = new SavedAction(instance);
+    item->setDefaultValue(64);
+    item->setValue(64);
+    item->setSettingsKey(group, QLatin1String("KillRingMaxSize"));
+    instance->insertItem(ConfigKillRingMaxSize, item);
+
+    item = new SavedAction(instance);
+    item->setDefaultValue(false);
+    item->setValue(false);
+    item->setSettingsKey(group, QLatin1String("ShareKillRing"));
+    item->setCheckable(true);
+    instance->insertItem(ConfigShareKillRing, item);
+
+    item = new SavedAction(instance);
+    item->setDefaultValue(false);
+    item->setValue(false);
+    item->setSettingsKey(group, QLatin1String("KillRingSelection"));
+    item->setCheckable(true);
+    instance->insertItem(ConfigKillRingSelection, item);
+
+    item = new SavedAction(instance);
+    item->setDefaultValue(true);
+    item->setValue(true);
+    item->setSettingsKey(group, QLatin1String("YankPopPreview"));
+    item->setCheckable(true);
+    instance->insertItem(ConfigYankPopPreview, item);
+
     item = new SavedAction(instance);
     item->setText(QCoreApplication::translate("EmacsKeys::Internal", "EmacsKeys properties..."));
     instance->insertItem(SettingsDialog, item);
@@ -29,6 +29,11 @@ namespace Internal {
 enum EmacsKeysSettingsCode
 {
 	ConfigUseEmacsKeys,
+	ConfigKillRingMaxEntries,
+	ConfigKillRingMaxSize, // in MB
+	ConfigShareKillRing,
+	ConfigKillRingSelection,
+	ConfigYankPopPreview,
 
 	// other actions
 	SettingsDialog,
@@ -0,0 +1,12 @@
+# Links the key handling engine, the EmacsKeysCore library that
+# core/core.pro builds. Set EMACSKEYSCORE_LIBDIR to its build directory
+# before including this.
+QT += gui
+greaterThan(QT_MAJOR_VERSION, 4): QT += widgets concurrent
+
+INCLUDEPATH += $$PWD
+DEPENDPATH += $$PWD
+
+LIBS += -L$$EMACSKEYSCORE_LIBDIR -lEmacsKeysCore
+win32-msvc*: PRE_TARGETDEPS += $$EMACSKEYSCORE_LIBDIR/EmacsKeysCore.lib
+else: PRE_TARGETDEPS += $$EMACSKEYSCORE_LIBDIR/libEmacsKeysCore.a
@@ -40,21 +40,25 @@
 //   The value of m_tc.anchor() is not used.
 //
 
-#include <utils/qtcassert.h>
-
-
 #include <QDebug>
+#include <QElapsedTimer>
 #include <QFile>
+#include <QHash>
 #include <QObject>
 #include <QPointer>
 #include <QProcess>
 #include <QRegExp>
 #include <QTextStream>
+#include <QTimer>
 #include <QtAlgorithms>
 #include <QStack>
+#include <QVector>
 
 #include <QApplication>
 #include <QKeyEvent>
+#include <QInputDialog>
+#include <QPaintEvent>
+#include <QLabel>
 #include <QLineEdit>
 #include <QPlainTextEdit>
 #include <QScrollBar>
@@ -64,8 +68,15 @@
 #include <QTextEdit>
 #include <QClipboard>
 
+#include "editoradapter.h"
+#include "latencystats.h"
+#include "documentstate.h"
+#include "globalmarkring.h"
+#include "incrementalsearch.h"
 #include "markring.h"
+#include "registers.h"
 #include "killring.h"
+#include "killringbrowser.h"
 
 #define DEBUG_GENERAL 0
 #if DEBUG_GENERAL
@@ -92,8 +103,6 @@
 #define NEW_REGION 1
 
 
-using namespace Utils;
-
 namespace EmacsKeys {
 namespace Internal {
 
@@ -117,8 +126,6 @@ namespace Internal {
 #define StartOfDocument QTextCursor::Start
 #define MoveMode        QTextCursor::MoveMode
 
-#define EDITOR(s) (m_textedit ? m_textedit->s : m_plaintextedit->s)
-#define EDITOR_WIDGET m_textedit ? qobject_cast<QWidget*>(m_textedit) : qobject_cast<QWidget*>(m_plaintextedit)
 
 const int ParagraphSeparator = 0x00002029;
 
@@ -155,7 +162,8 @@ enum EventResult
 class EmacsKeysHandler::Private
 {
 public:
-		Private(EmacsKeysHandler *parent, QWidget *widget);
+		Private(EmacsKeysHandler *parent, EditorAdapter *editor);
+		~Private();
 
 		EventResult handleEvent(QKeyEvent *ev);
 		bool wantsOverride(QKeyEvent *ev);
@@ -167,16 +175,87 @@ public:
 		friend class EmacsKeysHandler;
 
 		void init();
-		bool exactMatch(const QKeySequence& binding, const QKeySequence& keySequence);
 
-	void yankPop(QWidget* view);
+	void yankPop();
 	void setMark();
 	void exchangeDotAndMark();
+	void cmdPopGlobalMark();
+	void gotoLocation(const GlobalMarkRing::Location &location);
+	bool regionRange(int *start, int *end) const;
+
+	// registers, C-x r: the command reads the register name with the next
+	// key, see readCharacter
+	typedef void (Private::*CharacterHandler)(QChar c);
+	void readCharacter(CharacterHandler handler);
+	EventResult handleCharacter(QKeyEvent *ev);
+	CharacterHandler m_readCharacter; // waiting for a register name
+	QString m_macroInput; // what a command in a macro read, see MacroStep::text
+	void recordInput(const QString &input);
+	void cmdCopyToRegister() { readCharacter(&Private::copyToRegister); }
+	void cmdInsertRegister() { readCharacter(&Private::insertRegister); }
+	void cmdPointToRegister() { readCharacter(&Private::pointToRegister); }
+	void cmdJumpToRegister() { readCharacter(&Private::jumpToRegister); }
+	void copyToRegister(QChar name);
+	void insertRegister(QChar name);
+	void pointToRegister(QChar name);
+	void jumpToRegister(QChar name);
+
+	/* Rectangles, C-x r. Each command makes one pass over the blocks of
+	 * the rectangle in one edit block, each line is scanned once for both
+	 * edges by columnSpan. */
+	struct ColumnSpan
+	{
+		int start;       // first character at or across column left
+		int end;         // first character at or after column right
+		int startColumn; // column of start, < left inside a tab or short line
+		int endColumn;   // column of end, > right inside a tab
+	};
+	ColumnSpan columnSpan(const QString &text, int left, int right) const;
+	QString spanText(const QString &text, const ColumnSpan &span, int left, int right) const;
+	void replaceSpan(const QTextBlock &block, const ColumnSpan &span, int left, int right,
+			const QString &text);
+	bool rectangleBounds(QTextBlock *first, QTextBlock *last, int *left, int *right) const;
+	QStringList extractRectangle(QTextBlock block, const QTextBlock &last, int left, int right,
+			bool remove);
+	void insertRectangle(const QStringList &lines);
+	void cmdKillRectangle();
+	void cmdYankRectangle();
+	void cmdOpenRectangle();
+	void cmdClearRectangle();
+	void cmdStringRectangle();
+	void cmdCopyRectangleToRegister() { readCharacter(&Private::copyRectangleToRegister); }
+	void copyRectangleToRegister(QChar name);
+	// visual column of positionInBlock in block, tabs expanded to m_tabSize
+	int columnAt(const QTextBlock &block, int positionInBlock) const;
+	int m_tabSize;
+
+	/* isearch, C-s and C-r, and the regexp one on C-M-s and C-M-r. While a search is active handleEvent gives keys
+	 * to handleSearchKey first; IncrementalSearch reports matches through
+	 * EmacsKeysHandler::searchChanged, possibly later. Only the matches in
+	 * the viewport are highlighted. */
+	bool isSearching() const { return m_search && m_search->isActive(); }
+	bool searchTakesKey(QKeyEvent *ev) const;
+	bool handleSearchKey(QKeyEvent *ev);
+	void startSearch(bool forward, bool regexp = false);
+	void searchAgain(bool forward);
+	void endSearch(bool accept);
+	void showSearch();
+	void updateSearchHighlight();
+	void cmdSearchForward() { startSearch(true); }
+	void cmdSearchBackward() { startSearch(false); }
+	void cmdSearchForwardRegExp() { startSearch(true, true); }
+	void cmdSearchBackwardRegExp() { startSearch(false, true); }
+	IncrementalSearch *m_search;
+	int m_searchOrigin;
+	QString m_lastSearch;
+	QString m_lastRegExpSearch;
 	void popToMark(MoveMode move_mode);
 	void copy();
 	void cut();
 	void yank();
-	void killLine(bool augmentLine);
+	bool insertYank(const QString &text);
+	void cmdBrowseKillRing();
+	void killLine();
 	void killWord();
 	void backwardKillWord();
 
@@ -194,15 +273,24 @@ public:
 	void scrollUp(int count);
 	void scrollDown(int count) { scrollUp(-count); }
 
-	void moveToNextWord(MoveMode move_mode) { m_tc.movePosition(QTextCursor::NextWord, move_mode); }
-	void moveToPreviousWord(MoveMode move_mode) { m_tc.movePosition(QTextCursor::PreviousWord, move_mode); }
-	void moveToEndOfDocument(MoveMode move_mode) { m_tc.movePosition(EndOfDocument, move_mode); }
-	void moveToStartOfLine(MoveMode move_mode) { m_tc.movePosition(QTextCursor::StartOfLine, move_mode); }
-	void moveToEndOfLine(MoveMode move_mode) { m_tc.movePosition(QTextCursor::EndOfLine, move_mode); }
-	void moveUp(int n, MoveMode move_mode) { m_tc.movePosition(QTextCursor::Up, move_mode, n); }
-	void moveDown(int n, MoveMode move_mode) { m_tc.movePosition(Down, move_mode, n); }
-	void moveRight(int n, MoveMode move_mode) { m_tc.movePosition(Right, move_mode, n); }
-	void moveLeft(int n, MoveMode move_mode) { m_tc.movePosition(Left, move_mode, n); }
+	bool moveToNextWord(MoveMode move_mode) { return m_tc.movePosition(QTextCursor::NextWord, move_mode); }
+	bool moveToPreviousWord(MoveMode move_mode) { return m_tc.movePosition(QTextCursor::PreviousWord, move_mode); }
+	bool moveToEndOfDocument(MoveMode move_mode) { return m_tc.movePosition(EndOfDocument, move_mode); }
+	bool moveToStartOfLine(MoveMode move_mode) { return m_tc.movePosition(QTextCursor::StartOfLine, move_mode); }
+	bool moveToEndOfLine(MoveMode move_mode) { return m_tc.movePosition(QTextCursor::EndOfLine, move_mode); }
+	bool moveUp(int n, MoveMode move_mode) { return m_tc.movePosition(QTextCursor::Up, move_mode, n); }
+	bool moveDown(int n, MoveMode move_mode) { return m_tc.movePosition(Down, move_mode, n); }
+	bool moveRight(int n, MoveMode move_mode) { return m_tc.movePosition(Right, move_mode, n); }
+	bool moveLeft(int n, MoveMode move_mode) { return m_tc.movePosition(Left, move_mode, n); }
+	// one movePosition for a signed count, backward is used for n < 0
+	bool moveBy(QTextCursor::MoveOperation forward, QTextCursor::MoveOperation backward,
+			int n, MoveMode move_mode)
+	{ return n < 0 ? m_tc.movePosition(backward, move_mode, -n) : m_tc.movePosition(forward, move_mode, n); }
+	// selects count units from point and removes them in one edit
+	bool killBy(QTextCursor::MoveOperation forward, QTextCursor::MoveOperation backward,
+			int n, bool toKillRing);
+	// removes the selection, adding it to the current kill
+	void killSelection();
 
 	void setAnchor() { m_anchor = m_tc.position(); }
 	void setAnchor(int position) { m_anchor = position; }
@@ -214,50 +302,193 @@ public:
 	void beginEditBlock() { UNDO_DEBUG("BEGIN EDIT BLOCK"); m_tc.beginEditBlock(); }
 	void endEditBlock() { UNDO_DEBUG("END EDIT BLOCK"); m_tc.endEditBlock(); }
 
-	bool isMovementCommand(QKeySequence keySequence);
-	bool isEmacsCommand(QKeySequence keySequence);
-
-	/* Key bindings, see init for defs */
-	QKeySequence ks_moveDown;
-	QKeySequence ks_moveUp;
-	QKeySequence ks_moveStartLine;
-	QKeySequence ks_moveEndLine;
-	QKeySequence ks_moveLeft;
-	QKeySequence ks_moveRight;
-	QKeySequence ks_moveWordLeft;
-	QKeySequence ks_moveWordRight;
-	QKeySequence ks_moveDocStart;
-	QKeySequence ks_moveDocEnd;
-	QKeySequence ks_movePageDown;
-	QKeySequence ks_movePageUp;
-	QKeySequence ks_moveRecenter;
-
-	QKeySequence ks_killWord;
-	QKeySequence ks_backKillWord;
-	QKeySequence ks_deleteChar;
-	QKeySequence ks_setMark;
-	QKeySequence ks_setMark2;
-	QKeySequence ks_killLine;
-	QKeySequence ks_yank;
-	QKeySequence ks_yankPop;
-	QKeySequence ks_cut;
-	QKeySequence ks_copy;
-	QKeySequence ks_popToMark;
-	QKeySequence ks_exchangeDotAndMark;
-	QKeySequence ks_removeWhitespace;
-
-	QKeySequence ks_cancelMark; // MRJ - special - does this do anything?
+	/* Compiled keymap, see init for the bindings */
+	enum CommandFlag
+	{
+		NoCommandFlags = 0x0,
+		MovementCommand = 0x1, // moves point, extends an active region
+		KeepsRegion = 0x2,     // does not deactivate an active mark
+		MacroControl = 0x4,    // defines or runs macros, never recorded
+		ArgumentCommand = 0x8, // builds the prefix argument for the next command
+		RepeatableCommand = 0x10, // autorepeats fold into one counted call
+		KillCommand = 0x20     // adds to the kill of the previous kill command
+	};
+
+	struct Keymap;
+
+	struct Command
+	{
+		typedef void (Private::*Handler)();
+		Command() : handler(0), prefix(0), flags(NoCommandFlags), statsId(-1) {}
+		Command(Handler handler, int flags, int statsId)
+			: handler(handler), prefix(0), flags(flags), statsId(statsId) {}
+		explicit Command(const Keymap *prefix)
+			: handler(0), prefix(prefix), flags(NoCommandFlags), statsId(-1) {}
+		Handler handler;
+		const Keymap *prefix; // set for prefix keys like C-x, handler is 0 then
+		int flags;
+		int statsId; // LatencyStats command id
+	};
+
+	struct Keymap
+	{
+		QHash<int, Command> bindings;
+	};
+
+	enum { MaxPrefixLength = 4 }; // what fits into a QKeySequence
+
+	void bind(int keyCode, const char *name, Command::Handler handler, int flags = NoCommandFlags)
+	{ bind(&m_globalKeymap, keyCode, name, handler, flags); }
+	void bind(Keymap *keymap, int keyCode, const char *name, Command::Handler handler,
+			int flags = NoCommandFlags);
+	Keymap *definePrefix(Keymap *keymap, int keyCode);
+	const Command *lookupCommand(QKeyEvent *ev);
+	bool isPrefixPending() const { return m_prefixKeymap != 0; }
+	void resetPrefix();
+	void quitOrForwardPrefix();
+
+	/* Command handlers, bound to keys in init */
+	void cmdMoveDown() { if (!moveBy(Down, Up, m_count, m_moveMode)) fail(); }
+	void cmdMoveUp() { if (!moveBy(Up, Down, m_count, m_moveMode)) fail(); }
+	void cmdMoveStartLine() { moveBy(Down, Up, m_count - 1, m_moveMode); moveToStartOfLine(m_moveMode); }
+	void cmdMoveEndLine() { moveBy(Down, Up, m_count - 1, m_moveMode); moveToEndOfLine(m_moveMode); }
+	void cmdMoveLeft() { if (!moveBy(Left, Right, m_count, m_moveMode)) fail(); }
+	void cmdMoveRight() { if (!moveBy(Right, Left, m_count, m_moveMode)) fail(); }
+	void cmdMoveWordLeft() { if (!moveBy(QTextCursor::PreviousWord, QTextCursor::NextWord, m_count, m_moveMode)) fail(); }
+	void cmdMoveWordRight() { if (!moveBy(QTextCursor::NextWord, QTextCursor::PreviousWord, m_count, m_moveMode)) fail(); }
+	void cmdMoveDocStart() { m_tc.movePosition(StartOfDocument, m_moveMode); }
+	void cmdMoveDocEnd() { m_tc.movePosition(EndOfDocument, m_moveMode); }
+	void cmdMovePageDown();
+	void cmdMovePageUp();
+	void cmdMoveRecenter() { scrollUp(linesOnScreen() / 2 - cursorLineOnScreen()); }
+	void cmdDeleteChar();
+	void cmdYankPop() { yankPop(); }
+	void cmdPopToMark() { popToMark(MoveAnchor); }
+	void cmdCancelMark() {}
+	void cmdGotoLine();
+	void cmdDeleteBackwardChar();
+	void cmdUniversalArgument();
+	void cmdDigitArgument();
+	void cmdNegativeArgument();
+	void cmdKeyboardQuit();
+	void cmdStartMacro();
+	void cmdEndMacro();
+	void cmdCallMacro();
+
+	void runCommand(const Command *command, int count = 1, bool hasArgument = false,
+			bool numericArgument = false);
+
+	/* yank-pop preview: M-y shows the candidate in m_yankPreviewLabel and
+	 * marks the yanked text, the document changes once when cycling ends */
+	void showYankPreview(const QString &text);
+	void commitYankPreview();
+	void cancelYankPreview();
+	void finishYankPreview();
+	void documentContentsChanged(int position, int removed, int added);
+	bool m_yankPreviewEnabled;
+	bool m_yankPreviewActive;
+	int m_yankPreviewRevision; // of the document when the preview showed
+	QString m_yankPreviewText;
+	QPointer<QLabel> m_yankPreviewLabel;
+	// a command could not do its job, beeps and stops a running macro
+	void fail();
+	bool m_commandFailed;
+
+	/* Keyboard macros, recorded as resolved commands and inserted text */
+	struct MacroStep
+	{
+		MacroStep() : command(0), count(1), hasArgument(false), numericArgument(false) {}
+		const Command *command; // 0 for self-inserted text
+		int count;
+		bool hasArgument;
+		bool numericArgument;
+		QString text; // self-inserted text, or the register name the command read
+	};
+	void recordKey(const Command *command, QKeyEvent *ev);
+	void recordCommand(const Command *command, int count, bool hasArgument,
+			bool numericArgument);
+	void recordText(const QString &text);
+	void executeMacro(int count);
+	QVector<MacroStep> m_macro;
+	QVector<MacroStep> m_recordedMacro;
+	bool m_recordingMacro;
+	bool m_executingMacro;
+	// keys the editor handles itself, looked up only to record them
+	Keymap m_editingKeymap;
+
+	/* Prefix argument (C-u, C-u N, M-N, M--), collected by the argument
+	 * commands and passed to the next command as m_count */
+	enum ArgumentState
+	{
+		NoArgument,
+		UniversalArgument, // only C-u, m_argumentValue is 4^n
+		NegativeArgument,  // only -, means -1
+		DigitArgument
+	};
+	bool hasArgument() const { return m_argumentState != NoArgument; }
+	bool hasNumericArgument() const { return m_argumentState == DigitArgument; }
+	int argumentCount() const;
+	void resetArgument();
+	ArgumentState m_argumentState;
+	int m_argumentValue;
+	int m_argumentSign;
+	// plain digits and - continue an argument started with C-u
+	Keymap m_argumentKeymap;
+	int m_commandKey; // key code of the command being run
+	int m_count; // count for the running command, 1 without argument
+	bool m_hasArgument; // the running command got an explicit argument
+	bool m_numericArgument; // and it had digits, not just C-u or -
+
+	/* Key code (key + modifiers) to command, built once in init. Prefix
+	 * keys map to nested keymaps owned by m_prefixKeymaps. */
+	Keymap m_globalKeymap;
+	QList<Keymap *> m_prefixKeymaps;
+	// pending prefix, 0 when the next key is looked up in m_globalKeymap
+	const Keymap *m_prefixKeymap;
+	int m_prefixKeys[MaxPrefixLength];
+	int m_prefixLength;
+	// lookup cache, ShortcutOverride and KeyPress arrive for the same key
+	const Keymap *m_lookupKeymap;
+	int m_lookupKeyCode;
+	const Command *m_lookupCommand;
+	const Command *m_lastCommand;
+	MoveMode m_moveMode;
+
+	/* Autorepeat of a held movement key is counted in m_repeatCount and run
+	 * as one command per frame, or earlier when input lags too far behind */
+	enum { RepeatFrameMs = 16, MaxRepeatLagMs = 100 };
+	bool queueRepeat(const Command *command, QKeyEvent *ev);
+	void flushRepeat();
+	const Command *m_repeatCommand;
+	int m_repeatCount;
+	QTimer m_repeatTimer;
+	QElapsedTimer m_repeatLag;
+
+	// hands m_tc to the editor, timed for the stats of command
+	void syncCursor(const Command *command, int sizeClass);
+
+	/* Latency of the last command until the editor repaints what it
+	 * changed. Paints of other areas, like a blinking cursor elsewhere, do
+	 * not count; without a matching paint within PaintWindowMs, about two
+	 * frames, the sample is dropped. */
+	enum { PaintWindowMs = 33 };
+	void recordPaint(const QRect &rect);
+	QElapsedTimer m_paintTimer;
+	int m_paintStatsId;
+	int m_paintSizeClass;
+	QRect m_paintRect; // of the viewport, where the command changed it
 
 public:
-	QTextEdit *m_textedit;
-	QPlainTextEdit *m_plaintextedit;
+	EditorAdapter *m_editor; // owned
 	bool m_wasReadOnly; // saves read-only state of document
+	bool m_active; // emacs keys enabled, set by the owner of the handler
 
 	EmacsKeysHandler *q;
 	QTextCursor m_tc;
 	int m_anchor;
-	// MRJ - need to check that there is a different mark ring kept for each buffer...
-	MarkRing markRing;
+	// mark ring and yank range, shared by all views on the document;
+	// marks follow the edits of the document, see PositionTracker
+	DocumentState *m_state;
 
 	QString removeSelectedText();
 	int anchor() const { return m_anchor; }
@@ -269,106 +500,261 @@ public:
 
 	int m_cursorWidth;
 
-	int yankEndPosition;
-	int yankStartPosition;
 };
 
 
-EmacsKeysHandler::Private::Private(EmacsKeysHandler *parent, QWidget *widget)
+EmacsKeysHandler::Private::Private(EmacsKeysHandler *parent, EditorAdapter *editor)
 {
 	q = parent;
-	m_textedit = qobject_cast<QTextEdit *>(widget);
-	m_plaintextedit = qobject_cast<QPlainTextEdit *>(widget);
+	m_editor = editor;
+	// EditorAdapter::create() gave none, everything below needs an editor
+	if (!m_editor)
+		qFatal("EmacsKeysHandler: the widget is neither a QTextEdit nor a QPlainTextEdit");
 	init();
 }
 
 void EmacsKeysHandler::Private::init()
 {
+	m_active = true;
 	m_anchor = 0;
 	m_savedYankPosition = 0;
-	m_cursorWidth = EDITOR(cursorWidth());
-
-	// MRJ - for now... do not use Ctrl-X
-	ks_moveDown = QKeySequence(Qt::CTRL + Qt::Key_N);
-	ks_moveUp = QKeySequence(Qt::CTRL + Qt::Key_P);
-	ks_moveStartLine = QKeySequence(Qt::CTRL + Qt::Key_A);
-	ks_moveEndLine = QKeySequence(Qt::CTRL + Qt::Key_E);
-	ks_moveLeft = QKeySequence(Qt::CTRL + Qt::Key_B);
-	ks_moveRight = QKeySequence(Qt::CTRL + Qt::Key_F);
-	ks_moveWordLeft = QKeySequence(Qt::ALT + Qt::Key_B);
-	ks_moveWordRight = QKeySequence(Qt::ALT + Qt::Key_F);
-	ks_moveDocStart = QKeySequence(Qt::ALT + Qt::SHIFT + Qt::Key_Less);
-	ks_moveDocEnd = QKeySequence(Qt::ALT + Qt::SHIFT + Qt::Key_Greater);
-	ks_movePageUp = QKeySequence(Qt::CTRL + Qt::Key_V);
-	ks_movePageDown = QKeySequence(Qt::ALT + Qt::Key_V);
-	ks_moveRecenter = QKeySequence(Qt::CTRL + Qt::Key_J);
-
-	ks_killWord = QKeySequence(Qt::ALT + Qt::Key_D);
-	ks_backKillWord = QKeySequence(Qt::CTRL + Qt::Key_Backspace);
-	ks_deleteChar = QKeySequence(Qt::CTRL + Qt::Key_D);
-	ks_setMark = QKeySequence(Qt::CTRL + Qt::Key_Space);
-	ks_setMark2 = QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_At);
-	ks_killLine = QKeySequence(Qt::CTRL + Qt::Key_K);
-	ks_yank = QKeySequence(Qt::CTRL + Qt::Key_Y);
-	ks_yankPop = QKeySequence(Qt::ALT + Qt::Key_Y);
-	ks_cut = QKeySequence(Qt::CTRL + Qt::Key_W);
-	ks_copy = QKeySequence(Qt::ALT + Qt::Key_W);
-	// MRJ - can't do multi-key sequences right now, figure out why... this whole structure is convoluted, can make better
-	//ks_popToMark = QKeySequence(Qt::CTRL + Qt::Key_U, Qt::CTRL + Qt::Key_Space);
-	ks_popToMark = QKeySequence(Qt::CTRL + Qt::Key_M);
-	// MRJ - next is problematic... replace temporarily
-	//		ks_exchangeDotAndMark = QKeySequence(Qt::CTRL + Qt::Key_X, Qt::Key_X);
-	ks_exchangeDotAndMark = QKeySequence(Qt::CTRL + Qt::SHIFT + Qt::Key_M);
-	ks_removeWhitespace = QKeySequence(Qt::ALT + Qt::Key_Space);
-	ks_cancelMark = QKeySequence(Qt::CTRL + Qt::Key_G);
-}
-
-bool EmacsKeysHandler::Private::isMovementCommand(QKeySequence keySequence)
-{
-	return (exactMatch(ks_moveDown, keySequence) or
-					exactMatch(ks_moveUp, keySequence) or
-					exactMatch(ks_moveStartLine, keySequence) or
-					exactMatch(ks_moveEndLine, keySequence) or
-					exactMatch(ks_moveLeft, keySequence) or
-					exactMatch(ks_moveRight, keySequence) or
-					exactMatch(ks_moveWordLeft, keySequence) or
-					exactMatch(ks_moveWordRight, keySequence) or
-					exactMatch(ks_moveDocStart, keySequence) or
-					exactMatch(ks_moveDocEnd, keySequence) or
-					exactMatch(ks_movePageDown, keySequence) or
-					exactMatch(ks_movePageUp, keySequence) or
-					exactMatch(ks_exchangeDotAndMark, keySequence) or /* Because it selects a region */
-					exactMatch(ks_moveRecenter, keySequence));
-}
-
-bool EmacsKeysHandler::Private::isEmacsCommand(QKeySequence keySequence)
-{
-	return (exactMatch(ks_moveDown, keySequence) or
-					exactMatch(ks_moveUp, keySequence) or
-					exactMatch(ks_moveStartLine, keySequence) or
-					exactMatch(ks_moveEndLine, keySequence) or
-					exactMatch(ks_moveLeft, keySequence) or
-					exactMatch(ks_moveRight, keySequence) or
-					exactMatch(ks_moveWordLeft, keySequence) or
-					exactMatch(ks_moveWordRight, keySequence) or
-					exactMatch(ks_moveDocStart, keySequence) or
-					exactMatch(ks_moveDocEnd, keySequence) or
-					exactMatch(ks_movePageDown, keySequence) or
-					exactMatch(ks_movePageUp, keySequence) or
-					exactMatch(ks_moveRecenter, keySequence) or
-					exactMatch(ks_killWord, keySequence) or
-					exactMatch(ks_backKillWord, keySequence) or
-					exactMatch(ks_deleteChar, keySequence) or
-					exactMatch(ks_setMark, keySequence) or
-					exactMatch(ks_setMark2, keySequence) or
-					exactMatch(ks_killLine, keySequence) or
-					exactMatch(ks_yank, keySequence) or
-					exactMatch(ks_yankPop, keySequence) or
-					exactMatch(ks_cut, keySequence) or
-					exactMatch(ks_copy, keySequence) or
-					exactMatch(ks_popToMark, keySequence) or
-					exactMatch(ks_removeWhitespace, keySequence) or
-					exactMatch(ks_cancelMark, keySequence));
+	m_cursorWidth = m_editor->cursorWidth();
+
+	m_prefixKeymap = 0;
+	m_prefixLength = 0;
+	m_lookupKeymap = 0;
+	m_lookupKeyCode = 0;
+	m_lookupCommand = 0;
+	m_lastCommand = 0;
+	m_moveMode = MoveAnchor;
+	m_paintStatsId = -1;
+	m_paintSizeClass = 0;
+	m_commandFailed = false;
+	m_readCharacter = 0;
+	m_tabSize = 8;
+	m_search = 0;
+	m_searchOrigin = 0;
+	m_state = DocumentState::acquire(m_editor->document());
+	m_yankPreviewEnabled = true;
+	m_yankPreviewActive = false;
+	m_yankPreviewRevision = 0;
+	m_argumentState = NoArgument;
+	m_argumentValue = 1;
+	m_argumentSign = 1;
+	m_commandKey = 0;
+	m_count = 1;
+	m_hasArgument = false;
+	m_numericArgument = false;
+	m_recordingMacro = false;
+	m_executingMacro = false;
+	m_repeatCommand = 0;
+	m_repeatCount = 0;
+	m_repeatTimer.setSingleShot(true);
+	m_repeatTimer.setInterval(RepeatFrameMs);
+	QObject::connect(&m_repeatTimer, SIGNAL(timeout()), q, SLOT(flushRepeatedKeys()));
+	QObject::connect(m_editor->document(), SIGNAL(contentsChange(int,int,int)),
+			q, SLOT(documentContentsChanged(int,int,int)));
+
+	bind(Qt::CTRL + Qt::Key_N, "next-line", &Private::cmdMoveDown, MovementCommand | RepeatableCommand);
+	bind(Qt::CTRL + Qt::Key_P, "previous-line", &Private::cmdMoveUp, MovementCommand | RepeatableCommand);
+	bind(Qt::CTRL + Qt::Key_A, "move-beginning-of-line", &Private::cmdMoveStartLine, MovementCommand);
+	bind(Qt::CTRL + Qt::Key_E, "move-end-of-line", &Private::cmdMoveEndLine, MovementCommand);
+	bind(Qt::CTRL + Qt::Key_B, "backward-char", &Private::cmdMoveLeft, MovementCommand | RepeatableCommand);
+	bind(Qt::CTRL + Qt::Key_F, "forward-char", &Private::cmdMoveRight, MovementCommand | RepeatableCommand);
+	bind(Qt::ALT + Qt::Key_B, "backward-word", &Private::cmdMoveWordLeft, MovementCommand | RepeatableCommand);
+	bind(Qt::ALT + Qt::Key_F, "forward-word", &Private::cmdMoveWordRight, MovementCommand | RepeatableCommand);
+	bind(Qt::ALT + Qt::SHIFT + Qt::Key_Less, "beginning-of-buffer", &Private::cmdMoveDocStart, MovementCommand);
+	bind(Qt::ALT + Qt::SHIFT + Qt::Key_Greater, "end-of-buffer", &Private::cmdMoveDocEnd, MovementCommand);
+	bind(Qt::CTRL + Qt::Key_V, "scroll-down-command", &Private::cmdMovePageUp, MovementCommand);
+	bind(Qt::ALT + Qt::Key_V, "scroll-up-command", &Private::cmdMovePageDown, MovementCommand);
+	bind(Qt::CTRL + Qt::Key_J, "recenter", &Private::cmdMoveRecenter, MovementCommand);
+
+	bind(Qt::ALT + Qt::Key_D, "kill-word", &Private::killWord, KillCommand);
+	bind(Qt::CTRL + Qt::Key_Backspace, "backward-kill-word", &Private::backwardKillWord, KillCommand);
+	bind(Qt::CTRL + Qt::Key_D, "delete-char", &Private::cmdDeleteChar);
+	bind(Qt::CTRL + Qt::Key_Space, "set-mark-command", &Private::setMark, KeepsRegion);
+	bind(Qt::CTRL + Qt::SHIFT + Qt::Key_At, "set-mark-command", &Private::setMark, KeepsRegion);
+	bind(Qt::CTRL + Qt::Key_K, "kill-line", &Private::killLine, KillCommand);
+	bind(Qt::CTRL + Qt::Key_S, "isearch-forward", &Private::cmdSearchForward);
+	bind(Qt::CTRL + Qt::Key_R, "isearch-backward", &Private::cmdSearchBackward);
+	bind(Qt::CTRL + Qt::ALT + Qt::Key_S, "isearch-forward-regexp", &Private::cmdSearchForwardRegExp);
+	bind(Qt::CTRL + Qt::ALT + Qt::Key_R, "isearch-backward-regexp", &Private::cmdSearchBackwardRegExp);
+	bind(Qt::CTRL + Qt::Key_Y, "yank", &Private::yank);
+	bind(Qt::ALT + Qt::Key_Y, "yank-pop", &Private::cmdYankPop);
+	bind(Qt::CTRL + Qt::ALT + Qt::Key_Y, "browse-kill-ring", &Private::cmdBrowseKillRing);
+	bind(Qt::CTRL + Qt::Key_W, "kill-region", &Private::cut, KillCommand);
+	bind(Qt::ALT + Qt::Key_W, "kill-ring-save", &Private::copy);
+	bind(Qt::ALT + Qt::Key_Space, "just-one-space", &Private::removeWhitespace);
+	bind(Qt::CTRL + Qt::Key_G, "keyboard-quit", &Private::cmdKeyboardQuit);
+
+	// Prefix keys. Sequences not bound here are handed to Qt Creator's
+	// shortcuts (e.g. C-x C-s from EmacsKeys.kms), see quitOrForwardPrefix
+	Keymap *ctlXMap = definePrefix(&m_globalKeymap, Qt::CTRL + Qt::Key_X);
+	bind(ctlXMap, Qt::CTRL + Qt::Key_X, "exchange-point-and-mark", &Private::exchangeDotAndMark, KeepsRegion); /* Because it selects a region */
+	bind(ctlXMap, Qt::CTRL + Qt::Key_Space, "pop-global-mark", &Private::cmdPopGlobalMark);
+	Keymap *ctlXrMap = definePrefix(ctlXMap, Qt::Key_R); // registers and rectangles
+	bind(ctlXrMap, Qt::Key_S, "copy-to-register", &Private::cmdCopyToRegister);
+	bind(ctlXrMap, Qt::Key_X, "copy-to-register", &Private::cmdCopyToRegister);
+	bind(ctlXrMap, Qt::Key_I, "insert-register", &Private::cmdInsertRegister);
+	bind(ctlXrMap, Qt::Key_G, "insert-register", &Private::cmdInsertRegister);
+	bind(ctlXrMap, Qt::Key_Space, "point-to-register", &Private::cmdPointToRegister);
+	bind(ctlXrMap, Qt::Key_J, "jump-to-register", &Private::cmdJumpToRegister);
+	bind(ctlXrMap, Qt::Key_R, "copy-rectangle-to-register", &Private::cmdCopyRectangleToRegister);
+	bind(ctlXrMap, Qt::Key_K, "kill-rectangle", &Private::cmdKillRectangle);
+	bind(ctlXrMap, Qt::Key_Y, "yank-rectangle", &Private::cmdYankRectangle);
+	bind(ctlXrMap, Qt::Key_O, "open-rectangle", &Private::cmdOpenRectangle);
+	bind(ctlXrMap, Qt::Key_C, "clear-rectangle", &Private::cmdClearRectangle);
+	bind(ctlXrMap, Qt::Key_T, "string-rectangle", &Private::cmdStringRectangle);
+
+	// C-u C-SPC pops the mark, see setMark
+	bind(Qt::CTRL + Qt::Key_U, "universal-argument", &Private::cmdUniversalArgument, ArgumentCommand | KeepsRegion);
+	bind(Qt::ALT + Qt::Key_Minus, "negative-argument", &Private::cmdNegativeArgument, ArgumentCommand | KeepsRegion);
+	bind(&m_argumentKeymap, Qt::Key_Minus, "negative-argument", &Private::cmdNegativeArgument, ArgumentCommand | KeepsRegion);
+	for (int digit = Qt::Key_0; digit <= Qt::Key_9; ++digit) {
+		bind(Qt::ALT + digit, "digit-argument", &Private::cmdDigitArgument, ArgumentCommand | KeepsRegion);
+		bind(&m_argumentKeymap, digit, "digit-argument", &Private::cmdDigitArgument, ArgumentCommand | KeepsRegion);
+	}
+
+	bind(ctlXMap, Qt::SHIFT + Qt::Key_ParenLeft, "kmacro-start-macro", &Private::cmdStartMacro, MacroControl);
+	bind(ctlXMap, Qt::SHIFT + Qt::Key_ParenRight, "kmacro-end-macro", &Private::cmdEndMacro, MacroControl);
+	bind(ctlXMap, Qt::Key_E, "kmacro-end-and-call-macro", &Private::cmdCallMacro, MacroControl);
+
+	Keymap *metaGMap = definePrefix(&m_globalKeymap, Qt::ALT + Qt::Key_G);
+	bind(metaGMap, Qt::Key_G, "goto-line", &Private::cmdGotoLine, MovementCommand);
+	bind(metaGMap, Qt::ALT + Qt::Key_G, "goto-line", &Private::cmdGotoLine, MovementCommand);
+
+	bind(&m_editingKeymap, Qt::Key_Left, "backward-char", &Private::cmdMoveLeft, MovementCommand);
+	bind(&m_editingKeymap, Qt::Key_Right, "forward-char", &Private::cmdMoveRight, MovementCommand);
+	bind(&m_editingKeymap, Qt::Key_Up, "previous-line", &Private::cmdMoveUp, MovementCommand);
+	bind(&m_editingKeymap, Qt::Key_Down, "next-line", &Private::cmdMoveDown, MovementCommand);
+	bind(&m_editingKeymap, Qt::Key_Home, "move-beginning-of-line", &Private::cmdMoveStartLine, MovementCommand);
+	bind(&m_editingKeymap, Qt::Key_End, "move-end-of-line", &Private::cmdMoveEndLine, MovementCommand);
+	bind(&m_editingKeymap, Qt::Key_Delete, "delete-char", &Private::cmdDeleteChar);
+	bind(&m_editingKeymap, Qt::Key_Backspace, "delete-backward-char", &Private::cmdDeleteBackwardChar);
+}
+
+EmacsKeysHandler::Private::~Private()
+{
+	qDeleteAll(m_prefixKeymaps);
+	if (m_state->yankPreviewOwner == q)
+		m_state->yankPreviewOwner = 0;
+	DocumentState::release(m_state);
+	delete m_editor;
+}
+
+void EmacsKeysHandler::Private::bind(Keymap *keymap, int keyCode, const char *name,
+		Command::Handler handler, int flags)
+{
+	if (flags & MovementCommand)
+		flags |= KeepsRegion;
+	const int statsId = LatencyStats::instance()->registerCommand(name);
+	keymap->bindings.insert(keyCode, Command(handler, flags, statsId));
+}
+
+EmacsKeysHandler::Private::Keymap *EmacsKeysHandler::Private::definePrefix(Keymap *keymap, int keyCode)
+{
+	const Command command = keymap->bindings.value(keyCode);
+	if (command.prefix)
+		return const_cast<Keymap *>(command.prefix);
+	Keymap *prefix = new Keymap;
+	m_prefixKeymaps.append(prefix);
+	keymap->bindings.insert(keyCode, Command(prefix));
+	return prefix;
+}
+
+const EmacsKeysHandler::Private::Command *EmacsKeysHandler::Private::lookupCommand(QKeyEvent *ev)
+{
+	const int keyCode = ev->key() + int(ev->modifiers());
+	const Keymap *keymap = m_prefixKeymap ? m_prefixKeymap : &m_globalKeymap;
+	if (!m_prefixKeymap && hasArgument() && m_argumentKeymap.bindings.contains(keyCode))
+		keymap = &m_argumentKeymap;
+	if (keyCode != m_lookupKeyCode || keymap != m_lookupKeymap) {
+		QHash<int, Command>::const_iterator it = keymap->bindings.constFind(keyCode);
+		m_lookupKeymap = keymap;
+		m_lookupKeyCode = keyCode;
+		m_lookupCommand = it == keymap->bindings.constEnd() ? 0 : &it.value();
+	}
+	return m_lookupCommand;
+}
+
+void EmacsKeysHandler::Private::resetPrefix()
+{
+	m_prefixKeymap = 0;
+	for (int i = 0; i < m_prefixLength; ++i)
+		m_prefixKeys[i] = 0;
+	m_prefixLength = 0;
+}
+
+/* The key sequence in m_prefixKeys is not bound in our keymaps. C-g and Esc
+ * just quit the prefix like in emacs, everything else goes to the plugin
+ * which triggers the Qt Creator command with that shortcut. */
+void EmacsKeysHandler::Private::quitOrForwardPrefix()
+{
+	const int last = m_prefixKeys[m_prefixLength - 1];
+	if (last == Qt::CTRL + Qt::Key_G || last == Qt::Key_Escape) {
+		cancelYankPreview();
+	}
+	else {
+		// C-x C-s has to save the chosen entry
+		finishYankPreview();
+		QKeySequence sequence(m_prefixKeys[0], m_prefixKeys[1],
+				m_prefixKeys[2], m_prefixKeys[3]);
+		KEY_DEBUG("forwarding unbound sequence" << sequence);
+		emit q->unhandledKeySequence(sequence);
+	}
+	resetPrefix();
+	resetArgument();
+}
+
+int EmacsKeysHandler::Private::argumentCount() const
+{
+	switch (m_argumentState) {
+	case NoArgument:
+		return 1;
+	case NegativeArgument:
+		return -1;
+	default:
+		return m_argumentSign * m_argumentValue;
+	}
+}
+
+void EmacsKeysHandler::Private::resetArgument()
+{
+	m_argumentState = NoArgument;
+	m_argumentValue = 1;
+	m_argumentSign = 1;
+}
+
+void EmacsKeysHandler::Private::cmdUniversalArgument()
+{
+	if (m_argumentState == NoArgument) {
+		m_argumentState = UniversalArgument;
+		m_argumentValue = 4;
+	} else if (m_argumentState == UniversalArgument && m_argumentValue < (1 << 24)) {
+		m_argumentValue *= 4;
+	}
+}
+
+void EmacsKeysHandler::Private::cmdDigitArgument()
+{
+	const int digit = (m_commandKey & ~Qt::KeyboardModifierMask) - Qt::Key_0;
+	if (m_argumentState != DigitArgument) {
+		m_argumentState = DigitArgument;
+		m_argumentValue = digit;
+	} else if (m_argumentValue < 10000000) {
+		m_argumentValue = m_argumentValue * 10 + digit;
+	}
+}
+
+void EmacsKeysHandler::Private::cmdNegativeArgument()
+{
+	if (m_argumentState == DigitArgument) {
+		fail();
+		return;
+	}
+	m_argumentState = NegativeArgument;
+	m_argumentValue = 1;
+	m_argumentSign = -1;
 }
 
 bool EmacsKeysHandler::Private::wantsOverride(QKeyEvent *ev)
@@ -376,100 +762,924 @@ bool EmacsKeysHandler::Private::wantsOverride(QKeyEvent *ev)
 		const int key = ev->key();
 		KEY_DEBUG("  Wants override ?" << key);
 
+		/* A pending prefix or register name takes every key, Qt Creator
+		 * must not see the second half of C-x C-x */
+		if (isPrefixPending() || m_readCharacter) {
+			return key != Key_Shift && key != Key_Control && key != Key_Alt
+					&& key != Key_AltGr && key != Key_Meta;
+		}
+
+		if (isSearching() && searchTakesKey(ev)) {
+			return true;
+		}
+
 		/* Never override Esc */
 		if (key == Key_Escape) {
 			return false;
 		}
 
-		QKeySequence keySequence(ev->key() + ev->modifiers());
-		if(isEmacsCommand(keySequence)) {
-			KEY_DEBUG("  Not passing key sequence");
-			return true;
-		}
+		if(lookupCommand(ev)) {
+			KEY_DEBUG("  Not passing key sequence");
+			return true;
+		}
+
+		// Let other shortcuts trigger to qt-specified...
+		return false;
+}
+
+/* With an argument C-d and DEL kill, like Emacs */
+void EmacsKeysHandler::Private::cmdDeleteChar()
+{
+	if (!m_hasArgument && m_tc.hasSelection()) {
+		m_tc.deleteChar();
+	} else if (!killBy(QTextCursor::NextCharacter, QTextCursor::PreviousCharacter, m_count,
+			m_hasArgument)) {
+		fail();
+	}
+}
+
+void EmacsKeysHandler::Private::cmdDeleteBackwardChar()
+{
+	if (!m_hasArgument && m_tc.hasSelection()) {
+		m_tc.deletePreviousChar();
+	} else if (!killBy(QTextCursor::PreviousCharacter, QTextCursor::NextCharacter, m_count,
+			m_hasArgument)) {
+		fail();
+	}
+}
+
+/* Selects n units in one movePosition and removes them. Nothing is removed
+ * when point cannot move the whole count, like at the end of the buffer. */
+bool EmacsKeysHandler::Private::killBy(QTextCursor::MoveOperation forward,
+		QTextCursor::MoveOperation backward, int n, bool toKillRing)
+{
+	const int position = m_tc.position();
+	m_tc.clearSelection();
+	if (!moveBy(forward, backward, n, KeepAnchor) || position == m_tc.position()) {
+		m_tc.setPosition(position);
+		return false;
+	}
+	beginEditBlock();
+	if (toKillRing) {
+		killSelection();
+	} else {
+		m_tc.removeSelectedText();
+	}
+	endEditBlock();
+	return true;
+}
+
+void EmacsKeysHandler::Private::killSelection()
+{
+	// killing backward puts the text in front of the previous kill
+	KillRing::instance()->kill(m_tc.selectedText(), m_tc.position() < m_tc.anchor());
+	m_tc.removeSelectedText();
+}
+
+void EmacsKeysHandler::Private::cmdMovePageDown()
+{
+	moveDown((linesOnScreen() - 6) - cursorLineOnScreen(), m_moveMode);
+	scrollToLineInDocument(cursorLineInDocument());
+}
+
+void EmacsKeysHandler::Private::cmdMovePageUp()
+{
+	moveUp((linesOnScreen() - 6) + cursorLineOnScreen(), m_moveMode);
+	scrollToLineInDocument(cursorLineInDocument() + linesOnScreen() - 6);
+}
+
+void EmacsKeysHandler::Private::cmdGotoLine()
+{
+	if (m_hasArgument) {
+		const int line = qBound(1, m_count, linesInDocument());
+		m_tc.setPosition(m_tc.document()->findBlockByNumber(line - 1).position(), m_moveMode);
+		return;
+	}
+	// a macro replays the line it recorded, a cancelled dialog recorded none
+	bool ok = false;
+	int line = m_macroInput.toInt(&ok);
+	if (!m_executingMacro) {
+		line = QInputDialog::getInt(editor(), EmacsKeysHandler::tr("Goto Line"),
+				EmacsKeysHandler::tr("Goto line:"), cursorLineInDocument() + 1,
+				1, linesInDocument(), 1, &ok);
+		if (ok)
+			recordInput(QString::number(line));
+	}
+	if (ok) {
+		line = qBound(1, line, linesInDocument());
+		m_tc.setPosition(m_tc.document()->findBlockByNumber(line - 1).position(), m_moveMode);
+	}
+}
+
+/* The last yank and its range belong to the document, M-y works in any
+ * view of it; the preview is shown by one handler at a time, see
+ * DocumentState::yankPreviewOwner */
+void EmacsKeysHandler::Private::yankPop()
+{
+	GENERAL_DEBUG("yankPop called ");
+	if (KillRing::instance()->currentYankDocument() != m_state->document()) {
+		GENERAL_DEBUG("the last previous yank was not in this document");
+		// generate beep and return
+		fail();
+		return;
+	}
+
+	int position = m_tc.position();
+	if (position != m_state->yankEndPosition) {
+		GENERAL_DEBUG("Cursor has been moved in the meantime");
+		GENERAL_DEBUG("yank end position " << m_state->yankEndPosition);
+		fail();
+		return;
+	}
+
+	// M-- M-y and C-u -2 M-y go back to more recent entries
+	QString next;
+	KillRing *ring = KillRing::instance();
+	for (int i = 0; i < qMax(1, qAbs(m_count)); ++i) {
+		next = m_count < 0 ? ring->previous() : ring->next();
+	}
+	if (!next.isEmpty() && m_yankPreviewEnabled && !m_executingMacro) {
+		showYankPreview(next);
+	}
+	else if (!next.isEmpty()) {
+		GENERAL_DEBUG("yanking " << next);
+		beginEditBlock();
+		m_tc.setPosition(m_state->yankStartPosition, KeepAnchor);
+		m_tc.removeSelectedText();
+		m_tc.insertText(next);
+		m_state->yankEndPosition = m_tc.position();
+		endEditBlock();
+		KillRing::instance()->publishYank();
+	}
+	else {
+		GENERAL_DEBUG("killring empty");
+		fail();
+	}
+}
+
+
+void EmacsKeysHandler::Private::showYankPreview(const QString &text)
+{
+	enum { MaxPreviewChars = 2000, MaxPreviewLines = 12 };
+	m_yankPreviewText = text;
+	m_yankPreviewActive = true;
+	m_yankPreviewRevision = m_tc.document()->revision();
+	m_state->yankPreviewOwner = q;
+
+	QStringList lines = text.left(MaxPreviewChars).split(QLatin1Char('\n'));
+	const bool truncated = lines.size() > MaxPreviewLines || text.size() > MaxPreviewChars;
+	while (lines.size() > MaxPreviewLines)
+		lines.removeLast();
+	QString label = lines.join(QLatin1String("\n"));
+	if (truncated) {
+		label += EmacsKeysHandler::tr("\n... (%1 characters)").arg(text.size());
+	}
+
+	if (!m_yankPreviewLabel) {
+		m_yankPreviewLabel = new QLabel(m_editor->viewport());
+		m_yankPreviewLabel->setTextFormat(Qt::PlainText);
+		m_yankPreviewLabel->setFrameStyle(QFrame::Box | QFrame::Plain);
+		m_yankPreviewLabel->setAutoFillBackground(true);
+		m_yankPreviewLabel->setBackgroundRole(QPalette::ToolTipBase);
+		m_yankPreviewLabel->setForegroundRole(QPalette::ToolTipText);
+		m_yankPreviewLabel->setFont(editor()->font());
+	}
+	m_yankPreviewLabel->setText(label);
+	m_yankPreviewLabel->adjustSize();
+	QTextCursor start = m_tc;
+	start.setPosition(m_state->yankStartPosition);
+	m_yankPreviewLabel->move(m_editor->cursorRect(start).bottomLeft());
+	m_yankPreviewLabel->show();
+	m_yankPreviewLabel->raise();
+
+	// the text that the candidate replaces
+	QTextEdit::ExtraSelection sel;
+	sel.cursor = m_tc;
+	sel.cursor.setPosition(m_state->yankStartPosition);
+	sel.cursor.setPosition(m_state->yankEndPosition, KeepAnchor);
+	sel.format.setFontStrikeOut(true);
+	QList<QTextEdit::ExtraSelection> selections;
+	selections.append(sel);
+	emit q->selectionChanged(selections);
+}
+
+/* Replaces the yanked text with the previewed entry in one edit, only
+ * then the entry goes to the clipboard */
+void EmacsKeysHandler::Private::commitYankPreview()
+{
+	if (!m_yankPreviewActive)
+		return;
+	if (m_state->yankPreviewOwner != q) {
+		// M-y in another view of the document took the yank over
+		cancelYankPreview();
+		return;
+	}
+	const QString text = m_yankPreviewText;
+	// before the edit, documentContentsChanged must not take it for a
+	// change from elsewhere
+	cancelYankPreview();
+	int position = m_tc.position();
+	int anchor = m_tc.anchor();
+	beginEditBlock();
+	m_tc.setPosition(m_state->yankStartPosition);
+	m_tc.setPosition(m_state->yankEndPosition, KeepAnchor);
+	m_tc.insertText(text);
+	const int end = m_tc.position();
+	endEditBlock();
+
+	// point usually still sits at the end of the yank, anything the mouse
+	// put behind it moves with the replaced text
+	const int delta = end - m_state->yankEndPosition;
+	if (position >= m_state->yankEndPosition)
+		position += delta;
+	if (anchor >= m_state->yankEndPosition)
+		anchor += delta;
+	m_tc.setPosition(anchor);
+	m_tc.setPosition(position, KeepAnchor);
+	m_state->yankEndPosition = end;
+	KillRing::instance()->publishYank();
+}
+
+/* Commits a pending preview from outside a command, e.g. on focus loss */
+void EmacsKeysHandler::Private::finishYankPreview()
+{
+	if (!m_yankPreviewActive)
+		return;
+	m_tc = m_editor->textCursor();
+	commitYankPreview();
+	m_editor->setTextCursor(m_tc);
+}
+
+void EmacsKeysHandler::Private::cancelYankPreview()
+{
+	if (!m_yankPreviewActive)
+		return;
+	m_yankPreviewActive = false;
+	m_yankPreviewText.clear();
+	if (m_state->yankPreviewOwner == q)
+		m_state->yankPreviewOwner = 0;
+	if (m_yankPreviewLabel)
+		m_yankPreviewLabel->hide();
+	emit q->selectionChanged(QList<QTextEdit::ExtraSelection>());
+}
+
+// C-g, also drops a yank-pop preview
+void EmacsKeysHandler::Private::cmdKeyboardQuit()
+{
+	cancelYankPreview();
+}
+
+/* Drops a preview when text at or before the yank range changed, e.g. in
+ * another view of the document: the range does not hold any more. The
+ * highlighters only change formats, that leaves the revision alone. */
+void EmacsKeysHandler::Private::documentContentsChanged(int position, int removed, int added)
+{
+	if (!m_yankPreviewActive || position > m_state->yankEndPosition)
+		return;
+	if (removed == added && m_editor->document()->revision() == m_yankPreviewRevision)
+		return;
+	cancelYankPreview();
+}
+
+void EmacsKeysHandler::Private::setMark()
+{
+	GENERAL_DEBUG("set mark");
+	if (m_hasArgument) { // C-u C-SPC
+		popToMark(MoveAnchor);
+		return;
+	}
+	m_tc.clearSelection();
+	Mark mark(m_state->markRing.getMostRecentMark());
+	if(mark.position == m_tc.position()) { // toggle mark
+		m_state->markRing.toggleActive();
+	} else {
+		m_state->markRing.addMark(m_tc.position());
+		GlobalMarkRing::instance()->push(m_state, m_tc.position());
+	}
+}
+
+/* C-x C-SPC, other documents are opened by the owner of the handler, see
+ * openFileRequested */
+void EmacsKeysHandler::Private::cmdPopGlobalMark()
+{
+	GlobalMarkRing::Location location;
+	if (!GlobalMarkRing::instance()->pop(&location)) {
+		fail();
+		return;
+	}
+	gotoLocation(location);
+}
+
+void EmacsKeysHandler::Private::gotoLocation(const GlobalMarkRing::Location &location)
+{
+	if (location.state == m_state) {
+		m_tc.setPosition(location.position);
+	}
+	else if (!location.fileName.isEmpty()) {
+		emit q->openFileRequested(location.fileName, location.line, location.column);
+	}
+	else {
+		fail();
+	}
+}
+
+/* The selection, or point and the last mark when no region is active */
+bool EmacsKeysHandler::Private::regionRange(int *start, int *end) const
+{
+	if (m_tc.hasSelection()) {
+		*start = m_tc.selectionStart();
+		*end = m_tc.selectionEnd();
+		return true;
+	}
+	const Mark mark = m_state->markRing.getMostRecentMark();
+	if (!mark.valid)
+		return false;
+	*start = qMin(mark.position, m_tc.position());
+	*end = qMax(mark.position, m_tc.position());
+	return true;
+}
+
+/* The next key names the register. A macro replays the name it recorded
+ * instead, see handleCharacter. */
+void EmacsKeysHandler::Private::readCharacter(CharacterHandler handler)
+{
+	if (m_executingMacro) {
+		if (m_macroInput.isEmpty())
+			fail();
+		else
+			(this->*handler)(m_macroInput.at(0));
+		return;
+	}
+	m_readCharacter = handler;
+}
+
+/* Keeps what the last recorded command read with it, for replay */
+void EmacsKeysHandler::Private::recordInput(const QString &input)
+{
+	if (m_recordingMacro && !m_recordedMacro.isEmpty() && m_recordedMacro.last().command)
+		m_recordedMacro.last().text = input;
+}
+
+EventResult EmacsKeysHandler::Private::handleCharacter(QKeyEvent *ev)
+{
+	const CharacterHandler handler = m_readCharacter;
+	m_readCharacter = 0;
+	const QString text = ev->text();
+	if (text.isEmpty() || !text.at(0).isPrint()
+			|| (ev->modifiers() & (Qt::ControlModifier | Qt::AltModifier))) {
+		// C-g and other keys quit
+		m_commandFailed = true;
+		QApplication::beep();
+		return EventHandled;
+	}
+	recordInput(text.left(1));
+	m_tc = m_editor->textCursor();
+	m_tc.setVisualNavigation(true);
+	m_commandFailed = false;
+	(this->*handler)(text.at(0));
+	syncCursor(0, 0);
+	return EventHandled;
+}
+
+// C-x r s, C-u C-x r s also deletes the region
+void EmacsKeysHandler::Private::copyToRegister(QChar name)
+{
+	int start, end;
+	if (!Registers::isValid(name) || !regionRange(&start, &end)) {
+		fail();
+		return;
+	}
+	QTextCursor tc = m_tc;
+	tc.setPosition(start);
+	tc.setPosition(end, KeepAnchor);
+	Registers::instance()->setText(name, tc.selection().toPlainText());
+	if (m_hasArgument) {
+		beginEditBlock();
+		m_tc.setPosition(start);
+		m_tc.setPosition(end, KeepAnchor);
+		m_tc.removeSelectedText();
+		endEditBlock();
+	}
+	m_tc.clearSelection();
+}
+
+/* C-x r i, point before and mark after the text, C-u C-x r i the other
+ * way round. The text goes in with a single insert. */
+void EmacsKeysHandler::Private::insertRegister(QChar name)
+{
+	Registers *registers = Registers::instance();
+	switch (registers->type(name)) {
+	case Registers::Text: {
+		beginEditBlock();
+		m_tc.removeSelectedText();
+		const int start = m_tc.position();
+		m_tc.insertText(registers->text(name));
+		const int end = m_tc.position();
+		endEditBlock();
+		m_state->markRing.addMark(m_hasArgument ? start : end);
+		m_tc.setPosition(m_hasArgument ? end : start);
+		break;
+	}
+	case Registers::Rectangle:
+		insertRectangle(registers->rectangle(name));
+		break;
+	default:
+		fail();
+		break;
+	}
+}
+
+// C-x r SPC
+void EmacsKeysHandler::Private::pointToRegister(QChar name)
+{
+	if (!Registers::isValid(name)) {
+		fail();
+		return;
+	}
+	Registers::instance()->setPosition(name, m_state, m_tc.position());
+}
+
+// C-x r j, a position in another file goes through openFileRequested
+void EmacsKeysHandler::Private::jumpToRegister(QChar name)
+{
+	GlobalMarkRing::Location location;
+	if (!Registers::instance()->position(name, &location)) {
+		fail();
+		return;
+	}
+	gotoLocation(location);
+}
+
+/* Inserts lines as a rectangle with its upper left corner at point.
+ * Short lines are padded with spaces, lines are added at the end of the
+ * document as needed. Point ends at the end of the last inserted line,
+ * like yank-rectangle. */
+void EmacsKeysHandler::Private::insertRectangle(const QStringList &lines)
+{
+	if (lines.isEmpty()) {
+		fail();
+		return;
+	}
+	m_tc.clearSelection();
+	const int column = columnAt(m_tc.block(), m_tc.positionInBlock());
+	QTextBlock block = m_tc.block();
+	beginEditBlock();
+	m_state->markRing.addMark(m_tc.position());
+	for (int i = 0; i < lines.size(); ++i) {
+		if (!block.isValid()) {
+			m_tc.movePosition(QTextCursor::End);
+			m_tc.insertBlock();
+			block = m_tc.block();
+		}
+		const ColumnSpan span = columnSpan(block.text(), column, column);
+		replaceSpan(block, span, column, column, lines.at(i));
+		block = block.next();
+	}
+	endEditBlock();
+}
+
+/* The rectangle between point and mark, first and last block and the
+ * columns [left, right) */
+bool EmacsKeysHandler::Private::rectangleBounds(QTextBlock *first, QTextBlock *last,
+		int *left, int *right) const
+{
+	int start, end;
+	if (!regionRange(&start, &end))
+		return false;
+	QTextDocument *document = m_tc.document();
+	*first = document->findBlock(start);
+	*last = document->findBlock(end);
+	const int startColumn = columnAt(*first, start - first->position());
+	const int endColumn = columnAt(*last, end - last->position());
+	*left = qMin(startColumn, endColumn);
+	*right = qMax(startColumn, endColumn);
+	return true;
+}
+
+/* The lines of the rectangle from rectangleBounds, padded to its width,
+ * deleted when remove is set. Point goes to the upper left corner. */
+QStringList EmacsKeysHandler::Private::extractRectangle(QTextBlock block, const QTextBlock &last,
+		int left, int right, bool remove)
+{
+	QStringList lines;
+	if (remove)
+		beginEditBlock();
+	for (;; block = block.next()) {
+		const QString text = block.text();
+		const ColumnSpan span = columnSpan(text, left, right);
+		lines.append(spanText(text, span, left, right));
+		if (remove && span.endColumn > left)
+			replaceSpan(block, span, left, right, QString());
+		if (block == last)
+			break;
+	}
+	if (remove)
+		endEditBlock();
+	m_tc.clearSelection();
+	return lines;
+}
+
+// C-x r k, the rectangle is kept for C-x r y
+void EmacsKeysHandler::Private::cmdKillRectangle()
+{
+	QTextBlock first, last;
+	int left, right;
+	if (!rectangleBounds(&first, &last, &left, &right)) {
+		fail();
+		return;
+	}
+	Registers::instance()->setKilledRectangle(extractRectangle(first, last, left, right, true));
+	const ColumnSpan span = columnSpan(first.text(), left, left);
+	m_tc.setPosition(first.position() + span.start);
+}
+
+// C-x r y
+void EmacsKeysHandler::Private::cmdYankRectangle()
+{
+	insertRectangle(Registers::instance()->killedRectangle());
+}
+
+// C-x r r
+void EmacsKeysHandler::Private::copyRectangleToRegister(QChar name)
+{
+	if (!Registers::isValid(name)) {
+		fail();
+		return;
+	}
+	QTextBlock first, last;
+	int left, right;
+	if (!rectangleBounds(&first, &last, &left, &right)) {
+		fail();
+		return;
+	}
+	Registers::instance()->setRectangle(name,
+			extractRectangle(first, last, left, right, m_hasArgument));
+}
+
+// C-x r o, lines ending before the rectangle stay as they are
+void EmacsKeysHandler::Private::cmdOpenRectangle()
+{
+	QTextBlock block, last;
+	int left, right;
+	if (!rectangleBounds(&block, &last, &left, &right)) {
+		fail();
+		return;
+	}
+	const QTextBlock first = block;
+	const QString spaces(right - left, QLatin1Char(' '));
+	beginEditBlock();
+	for (;; block = block.next()) {
+		const QString text = block.text();
+		const ColumnSpan span = columnSpan(text, left, left);
+		if (span.end < text.size() || span.endColumn > left)
+			replaceSpan(block, span, left, left, spaces);
+		if (block == last)
+			break;
+	}
+	endEditBlock();
+	m_tc.setPosition(first.position() + columnSpan(first.text(), left, left).start);
+}
+
+// C-x r c, blanks the rectangle without padding short lines
+void EmacsKeysHandler::Private::cmdClearRectangle()
+{
+	QTextBlock block, last;
+	int left, right;
+	if (!rectangleBounds(&block, &last, &left, &right)) {
+		fail();
+		return;
+	}
+	beginEditBlock();
+	for (;; block = block.next()) {
+		const ColumnSpan span = columnSpan(block.text(), left, right);
+		if (span.endColumn > left) {
+			replaceSpan(block, span, left, right,
+					QString(qMin(span.endColumn, right) - left, QLatin1Char(' ')));
+		}
+		if (block == last)
+			break;
+	}
+	endEditBlock();
+	m_tc.clearSelection();
+}
+
+// C-x r t, point ends after the string on the last line
+void EmacsKeysHandler::Private::cmdStringRectangle()
+{
+	QTextBlock block, last;
+	int left, right;
+	if (!rectangleBounds(&block, &last, &left, &right)) {
+		fail();
+		return;
+	}
+	QString string = m_macroInput;
+	if (!m_executingMacro) {
+		bool ok = false;
+		string = QInputDialog::getText(editor(), EmacsKeysHandler::tr("String Rectangle"),
+				EmacsKeysHandler::tr("String rectangle:"), QLineEdit::Normal, QString(), &ok);
+		if (!ok) {
+			fail();
+			return;
+		}
+		recordInput(string);
+	}
+	beginEditBlock();
+	for (;; block = block.next()) {
+		const ColumnSpan span = columnSpan(block.text(), left, right);
+		replaceSpan(block, span, left, right, string);
+		if (block == last)
+			break;
+	}
+	endEditBlock();
+	m_tc.clearSelection();
+	m_tc.setPosition(last.position() + columnSpan(last.text(), left + string.size(),
+			left + string.size()).start);
+}
+
+bool EmacsKeysHandler::Private::searchTakesKey(QKeyEvent *ev) const
+{
+	const int key = ev->key();
+	const Qt::KeyboardModifiers modifiers = ev->modifiers();
+	if (modifiers & Qt::ControlModifier)
+		return key == Key_S || key == Key_R || key == Key_G;
+	if (modifiers & Qt::AltModifier)
+		return false;
+	if (key == Key_Backspace || key == Key_Return || key == Key_Enter)
+		return true;
+	const QString text = ev->text();
+	return !text.isEmpty() && text.at(0).isPrint();
+}
+
+bool EmacsKeysHandler::Private::handleSearchKey(QKeyEvent *ev)
+{
+	if (!searchTakesKey(ev)) {
+		endSearch(true);
+		return false;
+	}
+	const int key = ev->key();
+	if (ev->modifiers() & Qt::ControlModifier) {
+		if (key == Key_S) {
+			searchAgain(true);
+		}
+		else if (key == Key_R) {
+			searchAgain(false);
+		}
+		else if (m_search->isFailed() && !m_search->query().isEmpty()) {
+			// C-g drops the part of the query that is not found
+			while (m_search->isFailed() && m_search->back()) {}
+		}
+		else {
+			endSearch(false);
+		}
+	}
+	else if (key == Key_Backspace) {
+		if (!m_search->back())
+			QApplication::beep();
+	}
+	else if (key == Key_Return || key == Key_Enter) {
+		endSearch(true);
+	}
+	else {
+		m_search->setQuery(m_search->query() + ev->text());
+	}
+	if (isSearching())
+		showSearch();
+	return true;
+}
+
+// C-s, C-r, C-M-s, C-M-r; the mark is set where the search started when it ends
+void EmacsKeysHandler::Private::startSearch(bool forward, bool regexp)
+{
+	if (m_executingMacro) {
+		fail();
+		return;
+	}
+	if (!m_search) {
+		m_search = new IncrementalSearch(q);
+		QObject::connect(m_search, SIGNAL(changed()), q, SLOT(searchChanged()));
+	}
+	m_tc.clearSelection();
+	m_searchOrigin = m_tc.position();
+	m_search->start(m_tc.document(), m_searchOrigin, forward, regexp);
+	QObject::connect(m_editor->verticalScrollBar(), SIGNAL(valueChanged(int)),
+			q, SLOT(updateSearchHighlight()));
+	showSearch();
+}
 
-		// Let other shortcuts trigger to qt-specified...
-		return false;
+/* C-s C-s, an empty query takes the one of the last search of its kind */
+void EmacsKeysHandler::Private::searchAgain(bool forward)
+{
+	if (m_search->query().isEmpty()) {
+		const QString &last = m_search->isRegExp() ? m_lastRegExpSearch : m_lastSearch;
+		if (last.isEmpty()) {
+			QApplication::beep();
+			return;
+		}
+		m_search->searchAgain(forward);
+		m_search->setQuery(last);
+		return;
+	}
+	m_search->searchAgain(forward);
 }
 
-bool EmacsKeysHandler::Private::exactMatch(const QKeySequence& binding, const QKeySequence& keySequence)
+void EmacsKeysHandler::Private::endSearch(bool accept)
 {
-		return binding.matches(keySequence) == QKeySequence::ExactMatch;
+	if (!isSearching())
+		return;
+	if (!m_search->query().isEmpty()) {
+		if (m_search->isRegExp())
+			m_lastRegExpSearch = m_search->query();
+		else
+			m_lastSearch = m_search->query();
+	}
+	m_search->stop();
+	QObject::disconnect(m_editor->verticalScrollBar(), SIGNAL(valueChanged(int)),
+			q, SLOT(updateSearchHighlight()));
+
+	QTextCursor tc = m_editor->textCursor();
+	if (!accept) {
+		tc.setPosition(m_searchOrigin);
+		m_editor->setTextCursor(tc);
+	}
+	else if (tc.position() != m_searchOrigin) {
+		m_state->markRing.addMark(m_searchOrigin);
+		if (m_state->markRing.getMostRecentMark().active)
+			m_state->markRing.toggleActive();
+	}
+	m_tc = m_editor->textCursor();
+	emit q->selectionChanged(QList<QTextEdit::ExtraSelection>());
+	emit q->searchStatusChanged(QString());
 }
 
+/* Point to the match, the end of it searching forward */
+void EmacsKeysHandler::Private::showSearch()
+{
+	if (m_search->isFound()) {
+		QTextCursor tc = m_editor->textCursor();
+		tc.setPosition(m_search->isForward() ? m_search->matchEnd() : m_search->matchStart());
+		m_editor->setTextCursor(tc);
+		m_tc = tc;
+	}
+	else if (m_search->query().isEmpty()) {
+		QTextCursor tc = m_editor->textCursor();
+		tc.setPosition(m_searchOrigin);
+		m_editor->setTextCursor(tc);
+		m_tc = tc;
+	}
+	updateSearchHighlight();
+
+	QString status;
+	if (m_search->isFailed() && !m_search->isInvalid())
+		status += EmacsKeysHandler::tr("Failing ");
+	if (m_search->isWrapped())
+		status += EmacsKeysHandler::tr("Wrapped ");
+	if (m_search->isRegExp())
+		status += EmacsKeysHandler::tr("Regexp ");
+	status += m_search->isForward() ? EmacsKeysHandler::tr("I-search: ")
+			: EmacsKeysHandler::tr("I-search backward: ");
+	status += m_search->query();
+	if (m_search->isInvalid())
+		status += EmacsKeysHandler::tr(" [incomplete input]");
+	if (m_search->isSearching())
+		status += EmacsKeysHandler::tr(" [searching]");
+	emit q->searchStatusChanged(status);
+}
 
-void EmacsKeysHandler::Private::yankPop(QWidget* view)
+/* Highlights the matches between the first and the last visible block */
+void EmacsKeysHandler::Private::updateSearchHighlight()
 {
-	GENERAL_DEBUG("yankPop called ");
-	if (KillRing::instance()->currentYankView() != view) {
-		GENERAL_DEBUG("the last previous yank was not in this view");
-		// generate beep and return
-		QApplication::beep();
+	if (!isSearching())
 		return;
+	QList<QTextEdit::ExtraSelection> selections;
+	const QWidget *viewport = m_editor->viewport();
+	const QTextBlock first = m_editor->cursorForPosition(QPoint(0, 0)).block();
+	const QTextBlock last =
+			m_editor->cursorForPosition(QPoint(viewport->width(), viewport->height())).block();
+	const QPalette palette = m_editor->widget()->palette();
+	typedef QPair<int, int> Match;
+	foreach (const Match &match, m_search->matches(first, last)) {
+		QTextEdit::ExtraSelection sel;
+		sel.cursor = m_editor->textCursor();
+		sel.cursor.setPosition(match.first);
+		sel.cursor.setPosition(match.second, KeepAnchor);
+		const bool current = m_search->isFound() && match.first == m_search->matchStart();
+		sel.format.setBackground(current ? palette.color(QPalette::Highlight)
+				: QColor(200, 200, 20));
+		if (current)
+			sel.format.setForeground(palette.color(QPalette::HighlightedText));
+		selections.append(sel);
 	}
+	emit q->selectionChanged(selections);
+}
 
-	int position = m_tc.position();
-	if (position != yankEndPosition) {
-		GENERAL_DEBUG("Cursor has been moved in the meantime");
-		GENERAL_DEBUG("yank end position " << yankEndPosition);
-		QApplication::beep();
-		return;
+int EmacsKeysHandler::Private::columnAt(const QTextBlock &block, int positionInBlock) const
+{
+	const QString text = block.text();
+	const int end = qMin(positionInBlock, text.size());
+	int column = 0;
+	for (int i = 0; i < end; ++i) {
+		if (text.at(i) == QLatin1Char('\t'))
+			column += m_tabSize - column % m_tabSize;
+		else
+			++column;
 	}
+	return column;
+}
 
-	QString next(KillRing::instance()->next());
-	if (!next.isEmpty()) {
-		GENERAL_DEBUG("yanking " << next);
-		beginEditBlock();
-		m_tc.setPosition(yankStartPosition, KeepAnchor);
-		m_tc.removeSelectedText();
-		m_tc.insertText(next);
-		yankEndPosition = m_tc.position();
-		endEditBlock();
+/* One scan of text for the characters covering columns [left, right) */
+EmacsKeysHandler::Private::ColumnSpan EmacsKeysHandler::Private::columnSpan(
+		const QString &text, int left, int right) const
+{
+	ColumnSpan span;
+	int column = 0;
+	int i = 0;
+	for (; i < text.size(); ++i) {
+		const int next = text.at(i) == QLatin1Char('\t')
+				? column + m_tabSize - column % m_tabSize : column + 1;
+		if (next > left)
+			break;
+		column = next;
 	}
-	else {
-		GENERAL_DEBUG("killring empty");
-		QApplication::beep();
+	span.start = i;
+	span.startColumn = column;
+	for (; i < text.size() && column < right; ++i) {
+		column = text.at(i) == QLatin1Char('\t')
+				? column + m_tabSize - column % m_tabSize : column + 1;
 	}
+	span.end = i;
+	span.endColumn = column;
+	return span;
 }
 
-
-void EmacsKeysHandler::Private::setMark()
+/* The columns [left, right) of text as they look, tabs as spaces, padded
+ * to the width of the rectangle */
+QString EmacsKeysHandler::Private::spanText(const QString &text, const ColumnSpan &span,
+		int left, int right) const
 {
-	GENERAL_DEBUG("set mark");
-	m_tc.clearSelection();
-	Mark mark(markRing.getMostRecentMark());
-	if(mark.position == m_tc.position()) { // toggle mark
-		markRing.toggleActive();
-	} else {
-		markRing.addMark(m_tc.position());
+	QString columns;
+	columns.reserve(span.endColumn - span.startColumn);
+	int column = span.startColumn;
+	for (int i = span.start; i < span.end; ++i) {
+		if (text.at(i) == QLatin1Char('\t')) {
+			const int next = column + m_tabSize - column % m_tabSize;
+			columns += QString(next - column, QLatin1Char(' '));
+			column = next;
+		} else {
+			columns += text.at(i);
+			++column;
+		}
 	}
+	columns = columns.mid(qMax(0, left - span.startColumn), right - left);
+	if (columns.size() < right - left)
+		columns += QString(right - left - columns.size(), QLatin1Char(' '));
+	return columns;
+}
+
+/* Replaces the span with text in one edit. The part of a tab across an
+ * edge that lies outside the rectangle stays as spaces, a short line is
+ * padded up to left. */
+void EmacsKeysHandler::Private::replaceSpan(const QTextBlock &block, const ColumnSpan &span,
+		int left, int right, const QString &text)
+{
+	QString replacement;
+	if (span.startColumn < left)
+		replacement = QString(left - span.startColumn, QLatin1Char(' '));
+	replacement += text;
+	if (span.endColumn > right)
+		replacement += QString(span.endColumn - right, QLatin1Char(' '));
+	if (replacement.isEmpty() && span.start == span.end)
+		return;
+	m_tc.setPosition(block.position() + span.start);
+	m_tc.setPosition(block.position() + span.end, KeepAnchor);
+	m_tc.insertText(replacement);
 }
 
 
 void EmacsKeysHandler::Private::exchangeDotAndMark()
 {
 	GENERAL_DEBUG("exchange point and mark");
-	Mark mark(markRing.getMostRecentMark()); // Can you cycle through mark ring?
+	Mark mark(m_state->markRing.getMostRecentMark()); // Can you cycle through mark ring?
 	if (mark.valid) {
 		GENERAL_DEBUG("  going to position " << mark.position);
 		int position = m_tc.position();
-		markRing.addMark(position);
+		m_state->markRing.addMark(position);
 		m_tc.setPosition(mark.position, KeepAnchor);
 	}
 	else {
-		QApplication::beep();
+		fail();
 	}
 }
 
 void EmacsKeysHandler::Private::popToMark(MoveMode move_mode)
 {
 	GENERAL_DEBUG("pop mark");
-	Mark mark(markRing.getPreviousMark());
+	Mark mark(m_state->markRing.getPreviousMark());
 	if (mark.valid) {
 		GENERAL_DEBUG("  going to position " << mark.position);
 		m_tc.setPosition(mark.position, move_mode);
 	}
 	else {
-		QApplication::beep();
+		fail();
 	}
 }
 
@@ -478,15 +1688,13 @@ void EmacsKeysHandler::Private::copy()
 	GENERAL_DEBUG("emacs copy");
 #if NEW_REGION
 	if(m_tc.hasSelection()) {
-		beginEditBlock();
-		QApplication::clipboard()->setText(m_tc.selectedText());
+		KillRing::instance()->add(m_tc.selectedText());
 		m_tc.clearSelection();
-		endEditBlock();
 	} else {
-		QApplication::beep();
+		fail();
 	}
 #else
-	Mark mark(markRing.getMostRecentMark());
+	Mark mark(m_state->markRing.getMostRecentMark());
 	if (mark.valid) {
 		beginEditBlock();
 		int position = m_tc.position();
@@ -497,7 +1705,7 @@ void EmacsKeysHandler::Private::copy()
 		endEditBlock();
 	}
 	else {
-		QApplication::beep();
+		fail();
 	}
 #endif
 }
@@ -508,14 +1716,13 @@ void EmacsKeysHandler::Private::cut()
 #if NEW_REGION
 	if(m_tc.hasSelection()) {
 		beginEditBlock();
-		QApplication::clipboard()->setText(m_tc.selectedText());
-		m_tc.removeSelectedText();
+		killSelection();
 		endEditBlock();
 	} else {
-		QApplication::beep();
+		fail();
 	}
 #else
-	Mark mark(markRing.getMostRecentMark());
+	Mark mark(m_state->markRing.getMostRecentMark());
 	if (mark.valid) {
 		beginEditBlock();
 		m_tc.setPosition(mark.position, KeepAnchor);
@@ -524,7 +1731,7 @@ void EmacsKeysHandler::Private::cut()
 		endEditBlock();
 	}
 	else {
-		QApplication::beep();
+		fail();
 	}
 #endif
 }
@@ -532,54 +1739,86 @@ void EmacsKeysHandler::Private::cut()
 void EmacsKeysHandler::Private::yank()
 {
 	GENERAL_DEBUG("emacs yank");
-	int position = m_tc.position();
-	yankStartPosition = position;
-	EDITOR(paste()); // MRJ - want to use the clipboard?
-	yankEndPosition = m_tc.position();
-	if (position != yankEndPosition) {
-		KillRing::instance()->setCurrentYankView(EDITOR_WIDGET);
+	// plain text straight from the ring, no paste() and mime data; C-u N
+	// C-y yanks the Nth most recent kill
+	if (!insertYank(KillRing::instance()->yankText(m_numericArgument ? m_count - 1 : 0)))
+		return;
+	if (m_hasArgument && !m_numericArgument) {
+		// a bare C-u leaves point before the text and the mark after it
+		m_state->markRing.addMark(m_state->yankEndPosition);
+		if (m_state->markRing.getMostRecentMark().active)
+			m_state->markRing.toggleActive();
+		m_tc.setPosition(m_state->yankStartPosition);
+	}
+}
+
+/* Replaces the selection with text, the range is the one M-y replaces */
+bool EmacsKeysHandler::Private::insertYank(const QString &text)
+{
+	if (text.isEmpty()) {
+		fail();
+		return false;
+	}
+	beginEditBlock();
+	m_tc.removeSelectedText();
+	m_state->yankStartPosition = m_tc.position();
+	m_tc.insertText(text);
+	m_state->yankEndPosition = m_tc.position();
+	endEditBlock();
+	KillRing::instance()->setCurrentYankDocument(m_state->document());
+	return true;
+}
+
+// C-M-y, the chosen entry is yanked by EmacsKeysHandler::yankKillRingEntry
+void EmacsKeysHandler::Private::cmdBrowseKillRing()
+{
+	if (KillRing::instance()->count() == 0) {
+		fail();
+		return;
 	}
+	KillRingBrowser *browser = new KillRingBrowser(editor());
+	QObject::connect(browser, SIGNAL(entryChosen(int)), q, SLOT(yankKillRingEntry(int)));
+	browser->move(m_editor->viewport()->mapToGlobal(m_editor->cursorRect(m_tc).bottomLeft()));
+	browser->show();
+	browser->setFocus();
 }
 
-void EmacsKeysHandler::Private::killLine(bool augmentLine)
+void EmacsKeysHandler::Private::killLine()
 {
-	GENERAL_DEBUG("kill line" << augmentLine);
+	GENERAL_DEBUG("kill line" << m_count);
 	beginEditBlock();
 	int position = m_tc.position();
 	GENERAL_DEBUG("current position " << position);
-	m_tc.movePosition(EndOfLine, KeepAnchor);
+	if (m_hasArgument) {
+		// whole lines with their newlines, backward to line start for n <= 0
+		if (m_count > 0) {
+			if (!m_tc.movePosition(QTextCursor::NextBlock, KeepAnchor, m_count))
+				m_tc.movePosition(QTextCursor::End, KeepAnchor);
+		} else {
+			m_tc.movePosition(QTextCursor::StartOfBlock, KeepAnchor);
+			if (!m_tc.movePosition(QTextCursor::PreviousBlock, KeepAnchor, -m_count))
+				m_tc.movePosition(QTextCursor::Start, KeepAnchor);
+		}
+	} else {
+		m_tc.movePosition(EndOfLine, KeepAnchor);
 
-	if (position == m_tc.position()) {
-			GENERAL_DEBUG("at line end");
-			m_tc.movePosition(NextCharacter, KeepAnchor);
+		if (position == m_tc.position()) {
+				GENERAL_DEBUG("at line end");
+				m_tc.movePosition(NextCharacter, KeepAnchor);
+		}
 	}
 	GENERAL_DEBUG("invoke cut");
-	if(augmentLine) {
-		QApplication::clipboard()->setText(
-			QApplication::clipboard()->text() + m_tc.selectedText());
-	} else {
-		QApplication::clipboard()->setText(m_tc.selectedText());
-	}
-	m_tc.removeSelectedText();
+	killSelection();
 
 	endEditBlock();
 }
 
 void EmacsKeysHandler::Private::killWord()
 {
-	GENERAL_DEBUG("kill word");
-	int position = m_tc.position();
-	GENERAL_DEBUG("current position " << position);
-	beginEditBlock();
-	m_tc.movePosition(QTextCursor::NextWord, KeepAnchor);
-	if (position != m_tc.position()) {
-			GENERAL_DEBUG("invoke cut");
-			QApplication::clipboard()->setText(m_tc.selectedText());
-			m_tc.removeSelectedText();
-	} else {
-			QApplication::beep();
+	GENERAL_DEBUG("kill word" << m_count);
+	if (!killBy(QTextCursor::NextWord, QTextCursor::PreviousWord, m_count, true)) {
+			fail();
 	}
-	endEditBlock();
 }
 
 /* Expected behavior:
@@ -624,39 +1863,205 @@ void EmacsKeysHandler::Private::removeWhitespace()
 	}
 
 	m_tc.removeSelectedText();
-	m_tc.insertText(" ");
+	// just-one-space with an argument leaves that many spaces
+	m_tc.insertText(QString(qAbs(m_count), QLatin1Char(' ')));
 	endEditBlock();
 }
 
 void EmacsKeysHandler::Private::backwardKillWord()
 {
-	GENERAL_DEBUG("backwards kill word");
-	int position = m_tc.position();
-	GENERAL_DEBUG("current position " << position);
-	beginEditBlock();
-	m_tc.movePosition(QTextCursor::PreviousWord, KeepAnchor);
-	if (position != m_tc.position()) {
-			GENERAL_DEBUG("invoke cut");
-			QApplication::clipboard()->setText(m_tc.selectedText());
-			m_tc.removeSelectedText();
-	} else {
-			QApplication::beep();
+	GENERAL_DEBUG("backwards kill word" << m_count);
+	if (!killBy(QTextCursor::PreviousWord, QTextCursor::NextWord, m_count, true)) {
+			fail();
 	}
-	endEditBlock();
 }
 
 
-EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
+/* Runs command on m_tc, or just updates the region state for keys that go
+ * to the editor (command 0). Shared by key handling and macro playback. */
+void EmacsKeysHandler::Private::runCommand(const Command *command, int count, bool hasArgument,
+		bool numericArgument)
+{
+	m_count = count;
+	m_hasArgument = hasArgument;
+	m_numericArgument = numericArgument;
+	// the next command after a yank-pop preview commits it, C-g drops it
+	if (m_yankPreviewActive && !(command && (command->handler == &Private::cmdYankPop
+			|| command->handler == &Private::cmdKeyboardQuit
+			|| (command->flags & ArgumentCommand))))
+		commitYankPreview();
+	// any other command ends a sequence of kills, C-u keeps it going
+	if (!(command && (command->flags & (KillCommand | ArgumentCommand))))
+		KillRing::instance()->endKill();
+	Mark mark(m_state->markRing.getMostRecentMark());
+	m_moveMode = QTextCursor::MoveAnchor;
+	if(mark.active) {
+		m_moveMode = QTextCursor::KeepAnchor;
+	}
+
+	if (command) {
+		(this->*command->handler)();
+	}
+
+	mark = m_state->markRing.getMostRecentMark();
+	if(mark.active and not (command and (command->flags & KeepsRegion))) {
+		m_state->markRing.toggleActive();
+
+#if NEW_REGION
+		m_tc.clearSelection();
+					KEY_DEBUG("Have non-movement key, erase highlight");
+		//m_tc.setPosition(m_tc.position(), MoveAnchor);
+#else
+		onlyMovementSinceMark = false;
+		QList<QTextEdit::ExtraSelection> m_selections;
+		KEY_DEBUG("Have non-movement key, erase highlight");
+		q->selectionChanged(m_selections);
+#endif
+	}
+	m_lastCommand = command;
+}
+
+void EmacsKeysHandler::Private::fail()
+{
+	m_commandFailed = true;
+	if (!m_executingMacro) {
+		QApplication::beep();
+	}
+}
+
+void EmacsKeysHandler::Private::cmdStartMacro()
+{
+	GENERAL_DEBUG("start kbd macro");
+	m_recordedMacro.clear();
+	m_recordingMacro = true;
+}
+
+void EmacsKeysHandler::Private::cmdEndMacro()
+{
+	GENERAL_DEBUG("end kbd macro, steps:" << m_recordedMacro.size());
+	if (!m_recordingMacro) {
+		fail();
+		return;
+	}
+	m_recordingMacro = false;
+	m_macro = m_recordedMacro;
+	m_recordedMacro.clear();
+}
+
+void EmacsKeysHandler::Private::cmdCallMacro()
+{
+	if (m_recordingMacro) {
+		cmdEndMacro();
+	}
+	// C-u 0 C-x e repeats until the macro fails
+	executeMacro(m_hasArgument ? m_count : 1);
+}
+
+/* Records the command for the key, or for unbound keys what the editor is
+ * about to do with them: editing keys map to the equivalent command, text
+ * is appended to the previous text step. */
+void EmacsKeysHandler::Private::recordKey(const Command *command, QKeyEvent *ev)
+{
+	if (command) {
+		recordCommand(command, argumentCount(), hasArgument(), hasNumericArgument());
+		return;
+	}
+
+	QHash<int, Command>::const_iterator it =
+			m_editingKeymap.bindings.constFind(ev->key() + int(ev->modifiers()));
+	if (it != m_editingKeymap.bindings.constEnd()) {
+		recordCommand(&it.value(), argumentCount(), hasArgument(), hasNumericArgument());
+		return;
+	}
+
+	QString text = ev->text();
+	if (text.isEmpty() || (ev->modifiers() & (Qt::ControlModifier | Qt::AltModifier))) {
+		return;
+	}
+	const QChar c = text.at(0);
+	if (c == QLatin1Char('\r')) {
+		text = QLatin1String("\n");
+	} else if (!c.isPrint() && c != QLatin1Char('\t')) {
+		return;
+	}
+	const int count = hasArgument() ? argumentCount() : 1;
+	if (count < 1 && c.isPrint())
+		return;
+	recordText(text.repeated(qMax(1, count)));
+}
+
+void EmacsKeysHandler::Private::recordCommand(const Command *command, int count, bool hasArgument,
+		bool numericArgument)
+{
+	if (command->flags & (MacroControl | ArgumentCommand))
+		return;
+	MacroStep step;
+	step.command = command;
+	step.count = count;
+	step.hasArgument = hasArgument;
+	step.numericArgument = numericArgument;
+	m_recordedMacro.append(step);
+}
+
+void EmacsKeysHandler::Private::recordText(const QString &text)
+{
+	if (!m_recordedMacro.isEmpty() && !m_recordedMacro.last().command) {
+		m_recordedMacro.last().text += text;
+	} else {
+		MacroStep step;
+		step.text = text;
+		m_recordedMacro.append(step);
+	}
+}
+
+/* Runs the macro count times (count < 1: until it fails or stops changing
+ * anything) on m_tc inside one edit block. The editor sees neither the
+ * intermediate cursors nor repaints, handleEvent syncs the cursor once. */
+void EmacsKeysHandler::Private::executeMacro(int count)
 {
-		int key = ev->key();
-		const int mods = ev->modifiers();
-		QKeySequence keySequence(ev->key() + ev->modifiers());
+	if (m_macro.isEmpty() || m_executingMacro) {
+		fail();
+		return;
+	}
+	GENERAL_DEBUG("execute kbd macro" << count << "times");
 
-		static QKeySequence lastKeySequence = keySequence;
+	QWidget *viewport = m_editor->viewport();
+	const bool updatesEnabled = viewport->updatesEnabled();
+	viewport->setUpdatesEnabled(false);
+	m_executingMacro = true;
+	m_commandFailed = false;
+	beginEditBlock();
+	for (int i = 0; (count < 1 || i < count) && !m_commandFailed; ++i) {
+		const int revision = m_tc.document()->revision();
+		const int position = m_tc.position();
+		for (int s = 0; s < m_macro.size() && !m_commandFailed; ++s) {
+			const MacroStep &step = m_macro.at(s);
+			if (step.command) {
+				m_macroInput = step.text;
+				runCommand(step.command, step.count, step.hasArgument, step.numericArgument);
+			} else {
+				runCommand(0);
+				m_tc.insertText(step.text);
+			}
+		}
+		if (count < 1 && position == m_tc.position()
+				&& revision == m_tc.document()->revision()) {
+			break;
+		}
+	}
+	endEditBlock();
+	m_executingMacro = false;
+	viewport->setUpdatesEnabled(updatesEnabled);
+	if (m_commandFailed) {
+		QApplication::beep();
+	}
+}
 
-//		static bool onlyMovementSinceMark = false;
+EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
+{
+		const int key = ev->key();
 
-		GENERAL_DEBUG("sequence: " << keySequence);
+		GENERAL_DEBUG("key: " << key << " modifiers: " << ev->modifiers());
 
 		if (key == Key_Shift || key == Key_Alt || key == Key_Control
 						|| key == Key_Alt || key == Key_AltGr || key == Key_Meta)
@@ -665,104 +2070,86 @@ EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
 				return EventUnhandled;
 		}
 
+		if (m_readCharacter)
+			return handleCharacter(ev);
+
+		// keys that do not belong to the search end it and run as usual
+		if (isSearching() && handleSearchKey(ev))
+			return EventHandled;
+
+		const Command *command = lookupCommand(ev);
+		if (isPrefixPending() || (command && command->prefix)) {
+			if (m_prefixLength < MaxPrefixLength)
+				m_prefixKeys[m_prefixLength++] = key + int(ev->modifiers());
+			if (!command || (command->prefix && m_prefixLength == MaxPrefixLength)) {
+				quitOrForwardPrefix();
+				return EventHandled;
+			}
+			if (command->prefix) {
+				// wait for the rest of the sequence
+				m_prefixKeymap = command->prefix;
+				return EventHandled;
+			}
+			resetPrefix();
+		}
+
+		if (!command && hasArgument()) {
+			// C-u 3 Backspace, editing keys take the argument too
+			QHash<int, Command>::const_iterator it =
+					m_editingKeymap.bindings.constFind(key + int(ev->modifiers()));
+			if (it != m_editingKeymap.bindings.constEnd())
+				command = &it.value();
+		}
+
+		// a different key or a new press ends a held key
+		if (m_repeatCommand && (command != m_repeatCommand || !ev->isAutoRepeat()))
+			flushRepeat();
+		if (queueRepeat(command, ev))
+			return EventHandled;
+
 		// Fake "End of line"
-		m_tc = EDITOR(textCursor());
+		m_tc = m_editor->textCursor();
 
 		m_tc.setVisualNavigation(true);
 
-		// MRJ - don't think this code does anything...
-		if ((mods & Qt::ControlModifier) != 0) {
-				key += 256;
-				key += 32; // make it lower case
-		} else if (key >= Key_A && key <= Key_Z && (mods & Qt::ShiftModifier) == 0) {
-				key += 32;
-		}
-
-		Mark mark(markRing.getMostRecentMark());
-		MoveMode move_mode = QTextCursor::MoveAnchor;
-		if(mark.active) {
-			move_mode = QTextCursor::KeepAnchor;
-		}
-
-		EventResult result = EventHandled;
-		if (exactMatch(ks_moveDown, keySequence)) {
-				m_tc.movePosition(Down, move_mode);
-		} else if (exactMatch(ks_moveUp, keySequence)) {
-				m_tc.movePosition(Up, move_mode);
-		} else if (exactMatch(ks_moveStartLine, keySequence)) {
-				moveToStartOfLine(move_mode);
-		} else if (exactMatch(ks_moveEndLine, keySequence)) {
-				moveToEndOfLine(move_mode);
-		} else if (exactMatch(ks_moveLeft, keySequence)) {
-				moveLeft(1, move_mode);
-		} else if (exactMatch(ks_moveRight, keySequence)) {
-				moveRight(1, move_mode);
-		} else if (exactMatch(ks_moveWordLeft, keySequence)) {
-				moveToPreviousWord(move_mode);
-		} else if (exactMatch(ks_moveWordRight, keySequence)) {
-				moveToNextWord(move_mode);
-		} else if (exactMatch(ks_killWord, keySequence)) {
-				killWord();
-		} else if (exactMatch(ks_backKillWord, keySequence)) {
-				backwardKillWord();
-		} else if (exactMatch(ks_deleteChar, keySequence)) {
-				m_tc.deleteChar();
-		} else if (exactMatch(ks_moveDocStart, keySequence)) {
-				m_tc.movePosition(StartOfDocument, move_mode);
-		} else if (exactMatch(ks_moveDocEnd, keySequence)) {
-				m_tc.movePosition(EndOfDocument, move_mode);
-		} else if (exactMatch(ks_movePageDown, keySequence)) {
-				moveDown((linesOnScreen() - 6) - cursorLineOnScreen(), move_mode);
-				scrollToLineInDocument(cursorLineInDocument());
-		} else if (exactMatch(ks_movePageUp, keySequence)) {
-				moveUp((linesOnScreen() - 6) + cursorLineOnScreen(), move_mode);
-				scrollToLineInDocument(cursorLineInDocument() + linesOnScreen() - 6);
-		} else if (exactMatch(ks_setMark, keySequence)
-				|| exactMatch(ks_setMark2, keySequence)) {
-				setMark();
-		} else if (exactMatch(ks_killLine, keySequence)) {
-				killLine(exactMatch(ks_killLine, lastKeySequence));
-		} else if (exactMatch(ks_yank, keySequence)) {
-				yank();
-		} else if (exactMatch(ks_yankPop, keySequence)) {
-				yankPop(EDITOR_WIDGET);
-		} else if (exactMatch(ks_cut, keySequence)) {
-				cut();
-		} else if (exactMatch(ks_copy, keySequence)) {
-				copy();
-		} else if (exactMatch(ks_moveRecenter, keySequence)) {
-				scrollUp(linesOnScreen() / 2 - cursorLineOnScreen());
-		} else if (ks_popToMark.matches(keySequence) == QKeySequence::ExactMatch) {
-				popToMark(MoveAnchor);
-		} else if (ks_exchangeDotAndMark.matches(keySequence) == QKeySequence::ExactMatch) {
-				exchangeDotAndMark();
-		} else if(exactMatch(ks_removeWhitespace, keySequence)){
-			removeWhitespace();
-		} else {
-			result = EventUnhandled;
+		if (m_recordingMacro) {
+			recordKey(command, ev);
 		}
 
-		mark = markRing.getMostRecentMark();
-		if(mark.active and not (isMovementCommand(keySequence) or exactMatch(ks_setMark, keySequence) or exactMatch(ks_setMark2, keySequence))) {
-			markRing.toggleActive();
-
-#if NEW_REGION
-			m_tc.clearSelection();
-						KEY_DEBUG("Have non-movement key, erase highlight");
-			//m_tc.setPosition(m_tc.position(), MoveAnchor);
-#else
-			onlyMovementSinceMark = false;
-			QList<QTextEdit::ExtraSelection> m_selections;
-			KEY_DEBUG("Have non-movement key, erase highlight");
-			q->selectionChanged(m_selections);
-#endif
+		LatencyStats *stats = LatencyStats::instance();
+		const int sizeClass = LatencyStats::sizeClass(linesInDocument());
+		QElapsedTimer timer;
+		EventResult result = EventUnhandled;
+		if (command) {
+			timer.start();
+			m_commandKey = key + int(ev->modifiers());
+			runCommand(command, argumentCount(), hasArgument(), hasNumericArgument());
+			stats->record(command->statsId, LatencyStats::HandleEvent, sizeClass,
+					timer.nsecsElapsed());
+			if (!(command->flags & ArgumentCommand))
+				resetArgument();
+			result = EventHandled;
+		} else if (hasArgument() && argumentCount() != 1 && !ev->text().isEmpty()
+				&& ev->text().at(0).isPrint()
+				&& !(ev->modifiers() & (Qt::ControlModifier | Qt::AltModifier))) {
+			// C-u 80 - inserts the text count times in one edit, C-u 0 - and
+			// negative counts insert nothing
+			const int count = argumentCount();
+			runCommand(0);
+			if (count > 1)
+				m_tc.insertText(ev->text().repeated(count));
+			resetArgument();
+			result = EventHandled;
+		} else {
+			runCommand(0);
+			resetArgument();
 		}
 		// MRJ - new active scheme should eliminate need for this
 #if 0
 		if(onlyMovementSinceMark) {
 			KEY_DEBUG("Only movement, now check valid mark");
 			QTextCursor tc = m_tc;
-			Mark mark(markRing.getMostRecentMark());
+			Mark mark(m_state->markRing.getMostRecentMark());
 			if (mark.valid) {
 
 #if NEW_REGION
@@ -784,35 +2171,117 @@ EventResult EmacsKeysHandler::Private::handleEvent(QKeyEvent *ev)
 		}
 #endif
 
-		lastKeySequence = keySequence;
-		EDITOR(setTextCursor(m_tc));
+		syncCursor(command, sizeClass);
 		return result;
 }
 
+void EmacsKeysHandler::Private::syncCursor(const Command *command, int sizeClass)
+{
+	if (command) {
+		const QRect oldCursorRect = m_editor->cursorRect();
+		const int scrollValue = m_editor->verticalScrollBar()->value();
+		QElapsedTimer timer;
+		timer.start();
+		m_editor->setTextCursor(m_tc);
+		LatencyStats::instance()->record(command->statsId, LatencyStats::SetTextCursor,
+				sizeClass, timer.nsecsElapsed());
+		m_paintStatsId = command->statsId;
+		m_paintSizeClass = sizeClass;
+		// the cursor leaves one place and appears at another, edits are
+		// repainted from the cursor line on; scrolling repaints it all
+		if (m_editor->verticalScrollBar()->value() != scrollValue)
+			m_paintRect = m_editor->viewport()->rect();
+		else
+			m_paintRect = oldCursorRect.united(m_editor->cursorRect());
+		m_paintTimer.start();
+	} else {
+		m_editor->setTextCursor(m_tc);
+	}
+}
+
+/* Takes an autorepeat of a repeatable command without touching the editor.
+ * The first press runs normally, so a single C-n still moves at once. */
+bool EmacsKeysHandler::Private::queueRepeat(const Command *command, QKeyEvent *ev)
+{
+	if (!command || !(command->flags & RepeatableCommand) || !ev->isAutoRepeat()
+			|| hasArgument())
+		return false;
+	if (!m_repeatCommand) {
+		m_repeatCommand = command;
+		m_repeatCount = 0;
+		m_repeatLag.start();
+		m_repeatTimer.start();
+	}
+	++m_repeatCount;
+	if (m_repeatLag.elapsed() >= MaxRepeatLagMs)
+		flushRepeat();
+	return true;
+}
+
+/* Runs the queued autorepeats as one counted command with one cursor sync */
+void EmacsKeysHandler::Private::flushRepeat()
+{
+	const Command *command = m_repeatCommand;
+	if (!command)
+		return;
+	const int count = m_repeatCount;
+	m_repeatCommand = 0;
+	m_repeatCount = 0;
+	m_repeatTimer.stop();
+	KEY_DEBUG("flushing autorepeat" << count);
+
+	m_tc = m_editor->textCursor();
+	m_tc.setVisualNavigation(true);
+	if (m_recordingMacro)
+		recordCommand(command, count, false, false);
+
+	const int sizeClass = LatencyStats::sizeClass(linesInDocument());
+	QElapsedTimer timer;
+	timer.start();
+	runCommand(command, count, false);
+	LatencyStats::instance()->record(command->statsId, LatencyStats::HandleEvent,
+			sizeClass, timer.nsecsElapsed());
+	syncCursor(command, sizeClass);
+}
+
+void EmacsKeysHandler::Private::recordPaint(const QRect &rect)
+{
+	if (m_paintStatsId < 0)
+		return;
+	const qint64 nsecs = m_paintTimer.nsecsElapsed();
+	if (nsecs > qint64(PaintWindowMs) * 1000000) {
+		m_paintStatsId = -1;
+		return;
+	}
+	if (!rect.intersects(m_paintRect))
+		return;
+	LatencyStats::instance()->record(m_paintStatsId, LatencyStats::Paint,
+			m_paintSizeClass, nsecs);
+	m_paintStatsId = -1;
+}
+
 void EmacsKeysHandler::Private::installEventFilter()
 {
-		EDITOR(installEventFilter(q));
+		editor()->installEventFilter(q);
+		// paint events go to the viewport, not the editor itself
+		m_editor->viewport()->installEventFilter(q);
 }
 
 void EmacsKeysHandler::Private::setupWidget()
 {
 
-		//EDITOR(setCursorWidth(QFontMetrics(ed->font()).width(QChar('x')));
-		if (m_textedit) {
-				m_textedit->setLineWrapMode(QTextEdit::NoWrap);
-		} else if (m_plaintextedit) {
-				m_plaintextedit->setLineWrapMode(QPlainTextEdit::NoWrap);
-		}
-		m_wasReadOnly = EDITOR(isReadOnly());
-		//EDITOR(setReadOnly(true));
+		//m_editor->setCursorWidth(QFontMetrics(ed->font()).width(QChar('x')));
+		m_editor->setLineWrapping(false);
+		m_wasReadOnly = m_editor->isReadOnly();
+		//m_editor->setReadOnly(true);
 
 }
 
 void EmacsKeysHandler::Private::restoreWidget()
 {
-		EDITOR(setReadOnly(m_wasReadOnly));
-		EDITOR(setCursorWidth(m_cursorWidth));
-		EDITOR(setOverwriteMode(false));
+		m_editor->setReadOnly(m_wasReadOnly);
+		m_editor->setCursorWidth(m_cursorWidth);
+		m_editor->setOverwriteMode(false);
 }
 
 #if 0
@@ -852,7 +2321,7 @@ int EmacsKeysHandler::Private::cursorLineOnScreen() const
 {
 		if (!editor())
 				return 0;
-		QRect rect = EDITOR(cursorRect());
+		QRect rect = m_editor->cursorRect();
 		GENERAL_DEBUG("cursorLineOnScreen:" << rect.y() / rect.height());
 		return rect.y() / rect.height();
 }
@@ -861,8 +2330,8 @@ int EmacsKeysHandler::Private::linesOnScreen() const
 {
 		if (!editor())
 				return 1;
-		QRect rect = EDITOR(cursorRect());
-		return EDITOR(height()) / rect.height();
+		QRect rect = m_editor->cursorRect();
+		return editor()->height() / rect.height();
 }
 
 int EmacsKeysHandler::Private::cursorLineInDocument() const
@@ -878,7 +2347,7 @@ int EmacsKeysHandler::Private::linesInDocument() const
 void EmacsKeysHandler::Private::scrollToLineInDocument(int line)
 {
 		// FIXME: works only for QPlainTextEdit
-		QScrollBar *scrollBar = EDITOR(verticalScrollBar());
+		QScrollBar *scrollBar = m_editor->verticalScrollBar();
 		//qDebug() << "SCROLL: " << scrollBar->value() << line;
 		scrollBar->setValue(line);
 }
@@ -897,9 +2366,7 @@ QString EmacsKeysHandler::Private::selectedText() const
 
 QWidget *EmacsKeysHandler::Private::editor() const
 {
-		return m_textedit
-				? static_cast<QWidget *>(m_textedit)
-				: static_cast<QWidget *>(m_plaintextedit);
+		return m_editor->widget();
 }
 
 QString EmacsKeysHandler::Private::removeSelectedText()
@@ -923,7 +2390,11 @@ QString EmacsKeysHandler::Private::removeSelectedText()
 ///////////////////////////////////////////////////////////////////////
 
 EmacsKeysHandler::EmacsKeysHandler(QWidget *widget, QObject *parent)
-		: QObject(parent), d(new Private(this, widget))
+		: QObject(parent), d(new Private(this, EditorAdapter::create(widget)))
+{}
+
+EmacsKeysHandler::EmacsKeysHandler(EditorAdapter *editor, QObject *parent)
+		: QObject(parent), d(new Private(this, editor))
 {}
 
 EmacsKeysHandler::~EmacsKeysHandler()
@@ -942,7 +2413,7 @@ EmacsKeysHandler::~EmacsKeysHandler()
 
 bool EmacsKeysHandler::eventFilter(QObject *ob, QEvent *ev)
 {
-		bool active = theEmacsKeysSetting(ConfigUseEmacsKeys)->value().toBool();
+		const bool active = d->m_active;
 
 		KEY_DEBUG("STARTING");
 		if (active && ev->type() == QEvent::KeyPress && ob == d->editor()) {
@@ -962,9 +2433,50 @@ bool EmacsKeysHandler::eventFilter(QObject *ob, QEvent *ev)
 						return true;
 				}
 				KEY_DEBUG("NO SHORTCUT OVERRIDE" << kev->key());
+				// the shortcut may paste or save, finish a yank-pop preview and
+				// end a pending kill first
+				d->finishYankPreview();
+				// the search does not take the key, and a shortcut running
+				// instead keeps it from handleSearchKey: end the search here
+				const int key = kev->key();
+				if (d->isSearching() && key != Key_Shift && key != Key_Control
+						&& key != Key_Alt && key != Key_AltGr && key != Key_Meta)
+					d->endSearch(true);
+				KillRing::instance()->endKill();
+				// the clipboard follows the ring from a 0ms timer, too late only
+				// for a shortcut that uses the clipboard right away; typed text
+				// must not pay for setting it
+				if (kev->matches(QKeySequence::Paste) || kev->matches(QKeySequence::Copy)
+						|| kev->matches(QKeySequence::Cut))
+					KillRing::instance()->flushClipboard();
 				KEY_DEBUG("ENDING_3, return false");
 				return false; // MRJ 3/7 - why was this true?
 		}
+		if (ev->type() == QEvent::Paint && ob != d->editor()) {
+				d->recordPaint(static_cast<QPaintEvent *>(ev)->rect());
+				return false;
+		}
+
+		if (ev->type() == QEvent::KeyRelease && ob == d->editor()
+				&& !static_cast<QKeyEvent *>(ev)->isAutoRepeat()) {
+				d->flushRepeat();
+		}
+
+		if (ev->type() == QEvent::MouseButtonPress) {
+				// before the click moves point away from the yank
+				d->finishYankPreview();
+		}
+
+		if (ev->type() == QEvent::FocusOut && ob == d->editor()) {
+				d->flushRepeat();
+				d->finishYankPreview();
+				d->m_readCharacter = 0;
+				d->endSearch(true);
+				KillRing::instance()->endKill();
+				d->resetPrefix();
+				d->resetArgument();
+		}
+
 		bool ret_val = QObject::eventFilter(ob, ev);
 		KEY_DEBUG("ENDING_4, return %s" << (ret_val ? "true":"false"));
 
@@ -976,6 +2488,86 @@ void EmacsKeysHandler::installEventFilter()
 		d->installEventFilter();
 }
 
+void EmacsKeysHandler::setActive(bool on)
+{
+		if (!on) {
+				d->flushRepeat();
+				d->finishYankPreview();
+		}
+		d->m_active = on;
+		if (!on) {
+				d->resetPrefix();
+				d->m_readCharacter = 0;
+				d->endSearch(true);
+		}
+}
+
+void EmacsKeysHandler::setYankPopPreview(bool on)
+{
+		if (!on) {
+				d->finishYankPreview();
+		}
+		d->m_yankPreviewEnabled = on;
+}
+
+void EmacsKeysHandler::setFileName(const QString &fileName)
+{
+		d->m_state->setFileName(fileName);
+}
+
+void EmacsKeysHandler::setTabSize(int tabSize)
+{
+		d->m_tabSize = qMax(1, tabSize);
+}
+
+void EmacsKeysHandler::documentAboutToClose()
+{
+		d->m_state->close();
+}
+
+void EmacsKeysHandler::yankKillRingEntry(int id)
+{
+		d->m_tc = d->m_editor->textCursor();
+		// by id, the ring may have taken in clipboard text since the popup
+		// opened; nothing new is pulled in before yanking the chosen entry
+		d->insertYank(KillRing::instance()->yankEntryText(id));
+		d->m_editor->setTextCursor(d->m_tc);
+}
+
+void EmacsKeysHandler::searchChanged()
+{
+		d->showSearch();
+}
+
+void EmacsKeysHandler::updateSearchHighlight()
+{
+		d->updateSearchHighlight();
+}
+
+void EmacsKeysHandler::documentContentsChanged(int position, int removed, int added)
+{
+		d->documentContentsChanged(position, removed, added);
+}
+
+void EmacsKeysHandler::flushRepeatedKeys()
+{
+		d->flushRepeat();
+}
+
+bool EmacsKeysHandler::isActive() const
+{
+		return d->m_active;
+}
+
+EmacsKeysHandler::SearchResult EmacsKeysHandler::searchResult() const
+{
+		if (!d->isSearching())
+				return NoSearch;
+		if (d->m_search->isSearching())
+				return SearchRunning;
+		return d->m_search->isFound() ? SearchFound : SearchFailed;
+}
+
 void EmacsKeysHandler::setupWidget()
 {
 		d->setupWidget();
@@ -17,24 +17,51 @@
 #ifndef EMACSKEYS_HANDLER_H
 #define EMACSKEYS_HANDLER_H
 
-#include "emacskeysactions.h"
-
+#include <QKeySequence>
 #include <QObject>
 #include <QTextEdit>
 
 namespace EmacsKeys {
 namespace Internal {
 
+class EditorAdapter;
+
 class EmacsKeysHandler : public QObject
 {
     Q_OBJECT
 
 public:
+    // widget must be a QTextEdit or QPlainTextEdit, any other widget is a
+    // fatal error; EditorAdapter::create() returns 0 for those, check first
     EmacsKeysHandler(QWidget *widget, QObject *parent = 0);
+    // takes ownership of editor, which must not be 0
+    EmacsKeysHandler(EditorAdapter *editor, QObject *parent = 0);
     ~EmacsKeysHandler();
 
     QWidget *widget();
 
+    // the handler only takes keys while active
+    void setActive(bool on);
+    bool isActive() const;
+
+    // isearch scans run from a timer, tools replaying keys wait while the
+    // result is SearchRunning
+    enum SearchResult { NoSearch, SearchRunning, SearchFound, SearchFailed };
+    SearchResult searchResult() const;
+
+    // M-y previews the next kill ring entry and edits the document only
+    // once the cycling ends, C-g drops the preview
+    void setYankPopPreview(bool on);
+
+    // file of the edited document, global marks into it outlive the editor
+    void setFileName(const QString &fileName);
+    // columns per tab stop for rectangle commands, 8 by default
+    void setTabSize(int tabSize);
+    // call before the last view of a document closes, while the document
+    // is still there, so that global marks and position registers into it
+    // keep file and line
+    void documentAboutToClose();
+
 public slots:
 
     void installEventFilter();
@@ -47,10 +74,23 @@ signals:
 		void selectionChanged(const QList<QTextEdit::ExtraSelection> &selection);
     void quitRequested(bool force);
     void quitAllRequested(bool force);
+    // a prefix sequence like C-x C-s that is not bound in the handler
+    void unhandledKeySequence(const QKeySequence &sequence);
+    // a global mark in another document, line is 1-based, column 0-based
+    void openFileRequested(const QString &fileName, int line, int column);
+    // the isearch prompt, empty when the search ends
+    void searchStatusChanged(const QString &status);
 
 public:
     class Private;
 
+private slots:
+    void flushRepeatedKeys();
+    void yankKillRingEntry(int id);
+    void searchChanged();
+    void updateSearchHighlight();
+    void documentContentsChanged(int position, int removed, int added);
+
 private:
     bool eventFilter(QObject *ob, QEvent *ev);
     friend class Private;
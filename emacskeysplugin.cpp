@@ -16,7 +16,11 @@
 
 #include "emacskeysplugin.h"
 
+#include "editoradapter.h"
+#include "emacskeysactions.h"
 #include "emacskeyshandler.h"
+#include "killring.h"
+#include "latencystats.h"
 #include "ui_emacskeysoptions.h"
 
 #include <coreplugin/actionmanager/actionmanager.h>
@@ -40,7 +44,7 @@
 #include <texteditor/basetextmark.h>
 #include <texteditor/texteditorconstants.h>
 #include <texteditor/typingsettings.h>
-//#include <texteditor/tabsettings.h>
+#include <texteditor/tabsettings.h>
 #include <texteditor/icodestylepreferences.h>
 #include <texteditor/texteditorsettings.h>
 #include <texteditor/indenter.h>
@@ -53,20 +57,29 @@
 #include <texteditor/indenter.h>
 
 
+#include <QApplication>
 #include <QDebug>
 #include <QtPlugin>
 #include <QObject>
 #include <QPoint>
 #include <QSettings>
 #include <QHash>
+#include <QSet>
+#include <QTimer>
 
+#include <QClipboard>
+#include <QDir>
+#include <QFile>
+#include <QFileDialog>
 #include <QMessageBox>
 #include <QPlainTextEdit>
 #include <QTextBlock>
 #include <QTextCursor>
 #include <QTextEdit>
+#include <QTextStream>
 #include <QMainWindow>
 #include <QMenu>
+#include <QStatusBar>
 
 using namespace EmacsKeys::Internal;
 using namespace TextEditor;
@@ -112,6 +125,11 @@ public:
     void apply() { m_group.apply(ICore::instance()->settings()); }
     void finish() { m_group.finish(); }
 
+private slots:
+    void refreshLatency();
+    void resetLatency();
+    void saveLatency();
+
 private:
     friend class DebuggerPlugin;
     Ui::EmacsKeysOptionPage m_ui;
@@ -127,9 +145,60 @@ QWidget *EmacsKeysOptionPage::createPage(QWidget *parent)
     m_group.clear();
     m_group.insert(theEmacsKeysSetting(ConfigUseEmacsKeys), 
         m_ui.checkBoxUseEmacsKeys);
+    m_group.insert(theEmacsKeysSetting(ConfigKillRingMaxEntries),
+        m_ui.spinBoxKillRingMaxEntries);
+    m_group.insert(theEmacsKeysSetting(ConfigKillRingMaxSize),
+        m_ui.spinBoxKillRingMaxSize);
+    m_group.insert(theEmacsKeysSetting(ConfigShareKillRing),
+        m_ui.checkBoxShareKillRing);
+    m_group.insert(theEmacsKeysSetting(ConfigKillRingSelection),
+        m_ui.checkBoxKillRingSelection);
+    m_ui.checkBoxKillRingSelection->setEnabled(QApplication::clipboard()->supportsSelection());
+    m_group.insert(theEmacsKeysSetting(ConfigYankPopPreview),
+        m_ui.checkBoxYankPopPreview);
+
+    QFont font = m_ui.plainTextEditLatency->font();
+    font.setFamily(QLatin1String("Monospace"));
+    font.setStyleHint(QFont::TypeWriter);
+    m_ui.plainTextEditLatency->setFont(font);
+    connect(m_ui.pushButtonRefreshLatency, SIGNAL(clicked()), SLOT(refreshLatency()));
+    connect(m_ui.pushButtonResetLatency, SIGNAL(clicked()), SLOT(resetLatency()));
+    connect(m_ui.pushButtonSaveLatency, SIGNAL(clicked()), SLOT(saveLatency()));
+    refreshLatency();
     return w;
 }
 
+void EmacsKeysOptionPage::refreshLatency()
+{
+    m_ui.plainTextEditLatency->setPlainText(LatencyStats::instance()->summary());
+}
+
+void EmacsKeysOptionPage::resetLatency()
+{
+    LatencyStats::instance()->reset();
+    refreshLatency();
+}
+
+void EmacsKeysOptionPage::saveLatency()
+{
+    const QString fileName = QFileDialog::getSaveFileName(m_ui.plainTextEditLatency,
+        tr("Save Key Latency"), QString(), tr("CSV (*.csv);;JSON (*.json)"));
+    if (fileName.isEmpty())
+        return;
+
+    QFile file(fileName);
+    if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate | QIODevice::Text)) {
+        QMessageBox::warning(m_ui.plainTextEditLatency, tr("Save Key Latency"),
+            tr("Cannot write %1: %2").arg(fileName, file.errorString()));
+        return;
+    }
+    QTextStream out(&file);
+    if (fileName.endsWith(QLatin1String(".json"), Qt::CaseInsensitive))
+        LatencyStats::instance()->writeJson(out);
+    else
+        LatencyStats::instance()->writeCsv(out);
+}
+
 
 } // namespace Internal
 } // namespace EmacsKeys
@@ -162,14 +231,27 @@ private slots:
     void editorAboutToClose(Core::IEditor *);
 
     void setUseEmacsKeys(const QVariant &value);
+    void setKillRingLimits();
+    void setShareKillRing(const QVariant &value);
+    void setKillRingSelection(const QVariant &value);
+    void setYankPopPreview(const QVariant &value);
     void showSettingsDialog();
 
     void changeSelection(const QList<QTextEdit::ExtraSelection> &selections);
+    void triggerKeySequence(const QKeySequence &sequence);
+    void openFileAt(const QString &fileName, int line, int column);
+    void updateFileName();
+    void showSearchStatus(const QString &status);
+    void tabSettingsChanged();
+    void updateTabSizes();
 
 private:
     EmacsKeysPlugin *q;
     EmacsKeysOptionPage *m_emacsKeysOptionsPage;
     QHash<Core::IEditor *, EmacsKeysHandler *> m_editorToHandler;
+    QSet<QObject *> m_codeStyles; // connected to tabSettingsChanged
+
+    void watchCodeStyles();
 
     void triggerAction(const Core::Id &id);
 
@@ -195,6 +277,7 @@ void EmacsKeysPluginPrivate::shutdown()
     m_emacsKeysOptionsPage = 0;
     theEmacsKeysSettings()->writeSettings(Core::ICore::instance()->settings());
     delete theEmacsKeysSettings();
+    KillRing::instance()->sync();
 }
 
 bool EmacsKeysPluginPrivate::initialize()
@@ -237,6 +320,21 @@ bool EmacsKeysPluginPrivate::initialize()
         this, SLOT(showSettingsDialog()));
     connect(theEmacsKeysSetting(ConfigUseEmacsKeys), SIGNAL(valueChanged(QVariant)),
         this, SLOT(setUseEmacsKeys(QVariant)));
+    connect(theEmacsKeysSetting(ConfigKillRingMaxEntries), SIGNAL(valueChanged(QVariant)),
+        this, SLOT(setKillRingLimits()));
+    connect(theEmacsKeysSetting(ConfigKillRingMaxSize), SIGNAL(valueChanged(QVariant)),
+        this, SLOT(setKillRingLimits()));
+    setKillRingLimits();
+    connect(theEmacsKeysSetting(ConfigShareKillRing), SIGNAL(valueChanged(QVariant)),
+        this, SLOT(setShareKillRing(QVariant)));
+    setShareKillRing(theEmacsKeysSetting(ConfigShareKillRing)->value());
+    connect(theEmacsKeysSetting(ConfigKillRingSelection), SIGNAL(valueChanged(QVariant)),
+        this, SLOT(setKillRingSelection(QVariant)));
+    setKillRingSelection(theEmacsKeysSetting(ConfigKillRingSelection)->value());
+    connect(theEmacsKeysSetting(ConfigYankPopPreview), SIGNAL(valueChanged(QVariant)),
+        this, SLOT(setYankPopPreview(QVariant)));
+    KillRing::instance()->setStoreDirectory(
+        Core::ICore::userResourcePath() + QLatin1String("/emacskeys"));
 
     return true;
 }
@@ -257,6 +355,89 @@ void EmacsKeysPluginPrivate::triggerAction(const Id &id)
     action->trigger();
 }
 
+// The handler took the keys of a multi-key sequence that it does not bind
+// itself, run the Qt Creator command with that shortcut instead.
+void EmacsKeysPluginPrivate::triggerKeySequence(const QKeySequence &sequence)
+{
+    Core::ActionManager *am = ICore::actionManager();
+    QTC_ASSERT(am, return);
+    foreach (Core::Command *cmd, am->commands()) {
+        if (cmd->keySequence() != sequence || !cmd->isActive())
+            continue;
+        QAction *action = cmd->action();
+        if (action && action->isEnabled()) {
+            // C-x C-k cuts: a kill still waiting for the clipboard would
+            // land on it afterwards, or be missing from a paste
+            if (cmd->id() == Core::Id(Core::Constants::PASTE)
+                    || cmd->id() == Core::Id(Core::Constants::COPY)
+                    || cmd->id() == Core::Id(Core::Constants::CUT))
+                KillRing::instance()->flushClipboard();
+            action->trigger();
+            return;
+        }
+    }
+    QApplication::beep();
+}
+
+// Global marks in other files, an open editor is just activated.
+void EmacsKeysPluginPrivate::openFileAt(const QString &fileName, int line, int column)
+{
+    Core::EditorManager::instance()->openEditorAt(fileName, line, column);
+}
+
+// The isearch prompt, Emacs shows it in the echo area.
+void EmacsKeysPluginPrivate::showSearchStatus(const QString &status)
+{
+    if (status.isEmpty())
+        Core::ICore::statusBar()->clearMessage();
+    else
+        Core::ICore::statusBar()->showMessage(status);
+}
+
+void EmacsKeysPluginPrivate::updateFileName()
+{
+    Core::IDocument *document = qobject_cast<Core::IDocument *>(sender());
+    QTC_ASSERT(document, return);
+    QHash<Core::IEditor *, EmacsKeysHandler *>::const_iterator it = m_editorToHandler.constBegin();
+    for (; it != m_editorToHandler.constEnd(); ++it) {
+        if (it.key()->document() == document)
+            it.value()->setFileName(document->fileName());
+    }
+}
+
+// Rectangle commands count columns with the tab size of the editor.
+// Language code styles are registered by plugins loading after this one,
+// so new ones are picked up with every editor.
+void EmacsKeysPluginPrivate::watchCodeStyles()
+{
+    TextEditorSettings *settings = TextEditorSettings::instance();
+    QList<ICodeStylePreferences *> codeStyles = settings->codeStyles().values();
+    codeStyles.append(settings->codeStyle());
+    foreach (ICodeStylePreferences *codeStyle, codeStyles) {
+        if (!codeStyle || m_codeStyles.contains(codeStyle))
+            continue;
+        m_codeStyles.insert(codeStyle);
+        connect(codeStyle, SIGNAL(currentTabSettingsChanged(TextEditor::TabSettings)),
+            this, SLOT(tabSettingsChanged()));
+    }
+}
+
+void EmacsKeysPluginPrivate::tabSettingsChanged()
+{
+    // the editors take the new settings from the same signal, read them
+    // once they have
+    QTimer::singleShot(0, this, SLOT(updateTabSizes()));
+}
+
+void EmacsKeysPluginPrivate::updateTabSizes()
+{
+    QHash<Core::IEditor *, EmacsKeysHandler *>::const_iterator it = m_editorToHandler.constBegin();
+    for (; it != m_editorToHandler.constEnd(); ++it) {
+        if (BaseTextEditorWidget *bt = qobject_cast<BaseTextEditorWidget *>(it.key()->widget()))
+            it.value()->setTabSize(bt->tabSettings().m_tabSize);
+    }
+}
+
 void EmacsKeysPluginPrivate::editorOpened(Core::IEditor *editor)
 {
     if (!editor)
@@ -267,14 +448,31 @@ void EmacsKeysPluginPrivate::editorOpened(Core::IEditor *editor)
         return;
 
     // we can only handle QTextEdit and QPlainTextEdit
-    if (!qobject_cast<QTextEdit *>(widget) && !qobject_cast<QPlainTextEdit *>(widget))
+    EditorAdapter *adapter = EditorAdapter::create(widget);
+    if (!adapter)
         return;
     
-    EmacsKeysHandler *handler = new EmacsKeysHandler(widget, widget);
+    EmacsKeysHandler *handler = new EmacsKeysHandler(adapter, widget);
+    handler->setActive(theEmacsKeysSetting(ConfigUseEmacsKeys)->value().toBool());
+    handler->setYankPopPreview(theEmacsKeysSetting(ConfigYankPopPreview)->value().toBool());
+    if (BaseTextEditorWidget *bt = qobject_cast<BaseTextEditorWidget *>(widget))
+        handler->setTabSize(bt->tabSettings().m_tabSize);
     m_editorToHandler[editor] = handler;
+    watchCodeStyles();
 
     connect(handler, SIGNAL(selectionChanged(QList<QTextEdit::ExtraSelection>)),
         this, SLOT(changeSelection(QList<QTextEdit::ExtraSelection>)));
+    connect(handler, SIGNAL(unhandledKeySequence(QKeySequence)),
+        this, SLOT(triggerKeySequence(QKeySequence)));
+    connect(handler, SIGNAL(openFileRequested(QString,int,int)),
+        this, SLOT(openFileAt(QString,int,int)));
+    connect(handler, SIGNAL(searchStatusChanged(QString)),
+        this, SLOT(showSearchStatus(QString)));
+    if (Core::IDocument *document = editor->document()) {
+        handler->setFileName(document->fileName());
+        // Save As renames the document
+        connect(document, SIGNAL(changed()), this, SLOT(updateFileName()));
+    }
 
     handler->installEventFilter();
     
@@ -283,7 +481,44 @@ void EmacsKeysPluginPrivate::editorOpened(Core::IEditor *editor)
 void EmacsKeysPluginPrivate::editorAboutToClose(Core::IEditor *editor)
 {
     //qDebug() << "CLOSING: " << editor << editor->widget();
-    m_editorToHandler.remove(editor);
+    EmacsKeysHandler *handler = m_editorToHandler.take(editor);
+    if (!handler)
+        return;
+    // the handler goes after the widget and its document; marks into the
+    // file need the text now, once its last view closes
+    foreach (Core::IEditor *other, m_editorToHandler.keys()) {
+        if (other->document() == editor->document())
+            return;
+    }
+    handler->documentAboutToClose();
+}
+
+void EmacsKeysPluginPrivate::setKillRingLimits()
+{
+    KillRing *killRing = KillRing::instance();
+    killRing->setMaxEntries(theEmacsKeysSetting(ConfigKillRingMaxEntries)->value().toInt());
+    killRing->setMaxBytes(
+        qint64(theEmacsKeysSetting(ConfigKillRingMaxSize)->value().toInt()) << 20);
+}
+
+// All instances of one user attach to the same segment.
+void EmacsKeysPluginPrivate::setShareKillRing(const QVariant &value)
+{
+    QString key;
+    if (value.toBool())
+        key = QLatin1String("EmacsKeysKillRing-") + QString::number(qHash(QDir::homePath()));
+    KillRing::instance()->setSharedKey(key);
+}
+
+void EmacsKeysPluginPrivate::setKillRingSelection(const QVariant &value)
+{
+    KillRing::instance()->setSelectionIngestion(value.toBool());
+}
+
+void EmacsKeysPluginPrivate::setYankPopPreview(const QVariant &value)
+{
+    foreach (EmacsKeysHandler *handler, m_editorToHandler)
+        handler->setYankPopPreview(value.toBool());
 }
 
 void EmacsKeysPluginPrivate::setUseEmacsKeys(const QVariant &value)
@@ -291,11 +526,15 @@ void EmacsKeysPluginPrivate::setUseEmacsKeys(const QVariant &value)
     qDebug() << "SET USE EMACSKEYS" << value;
     bool on = value.toBool();
     if (on) {
-        foreach (Core::IEditor *editor, m_editorToHandler.keys())
+        foreach (Core::IEditor *editor, m_editorToHandler.keys()) {
+            m_editorToHandler[editor]->setActive(true);
             m_editorToHandler[editor]->setupWidget();
+        }
     } else {
-        foreach (Core::IEditor *editor, m_editorToHandler.keys())
+        foreach (Core::IEditor *editor, m_editorToHandler.keys()) {
+            m_editorToHandler[editor]->setActive(false);
             m_editorToHandler[editor]->restoreWidget();
+        }
     }
 }
 
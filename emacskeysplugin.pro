@@ -0,0 +1,29 @@
+TEMPLATE = lib
+TARGET = EmacsKeys
+
+# CONFIG += single
+include(../../qtcreatorplugin.pri)
+include(../../plugins/coreplugin/coreplugin.pri)
+include(../../plugins/texteditor/texteditor.pri)
+include(../../plugins/find/find.pri)
+include(../../plugins/projectexplorer/projectexplorer.pri)
+
+# DEFINES += QT_NO_CAST_FROM_ASCII QT_NO_CAST_TO_ASCII
+QT += gui
+
+EMACSKEYSCORE_LIBDIR = $$OUT_PWD/core
+include(emacskeyscore.pri)
+
+SOURCES += \
+    emacskeysactions.cpp \
+    emacskeysplugin.cpp
+
+HEADERS += \
+    emacskeysactions.h \
+    emacskeysplugin.h
+
+
+FORMS += \
+    emacskeysoptions.ui
+
+OTHER_FILES += EmacsKeys.pluginspec
@@ -0,0 +1,83 @@
+#include "globalmarkring.h"
+#include "documentstate.h"
+
+void GlobalMarkRing::push(DocumentState* state, int position)
+{
+  if (!records.isEmpty() && records.first().state == state) {
+    return;
+  }
+  Record record;
+  record.state = state;
+  record.handle = state->positions.add(position);
+  record.line = 0;
+  record.column = 0;
+  records.prepend(record);
+  while (records.size() > MaxRecords) {
+    drop(records.last());
+    records.removeLast();
+  }
+}
+
+bool GlobalMarkRing::pop(Location* location)
+{
+  if (records.isEmpty()) {
+    return false;
+  }
+  const Record record = records.first();
+  records.remove(0);
+  records.append(record);
+
+  location->state = record.state;
+  location->position = -1;
+  location->fileName = record.fileName;
+  location->line = record.line;
+  location->column = record.column;
+  if (record.state) {
+    location->position = record.state->positions.position(record.handle);
+    location->fileName = record.state->fileName();
+    record.state->lineAndColumn(location->position, &location->line, &location->column);
+  }
+  return true;
+}
+
+void GlobalMarkRing::documentClosed(DocumentState* state)
+{
+  int kept = 0;
+  for (int i = 0; i < records.size(); ++i) {
+    Record& record = records[i];
+    if (record.state == state) {
+      // without a file or text there is nothing to come back to
+      if (state->fileName().isEmpty() || !state->document()) {
+        continue;
+      }
+      state->lineAndColumn(state->positions.position(record.handle),
+          &record.line, &record.column);
+      record.fileName = state->fileName();
+      record.state = 0;
+      record.handle = -1;
+    }
+    records[kept++] = record;
+  }
+  records.resize(kept);
+}
+
+int GlobalMarkRing::count() const
+{
+  return records.size();
+}
+
+void GlobalMarkRing::drop(const Record& record)
+{
+  if (record.state) {
+    record.state->positions.remove(record.handle);
+  }
+}
+
+GlobalMarkRing* GlobalMarkRing::instance()
+{
+  static GlobalMarkRing* instance;
+  if (!instance) {
+    instance = new GlobalMarkRing();
+  }
+  return instance;
+}
@@ -0,0 +1,51 @@
+#ifndef GLOBALMARKRING_H
+#define GLOBALMARKRING_H
+
+#include <QString>
+#include <QVector>
+
+class DocumentState;
+
+/* Marks across documents, for C-x C-SPC. A record of an open document is
+ * its DocumentState and a handle into its PositionTracker, so the mark
+ * follows edits. When the document closes its records turn into file name
+ * and line, which cost nothing until a pop opens the file again. */
+class GlobalMarkRing
+{
+public:
+  struct Location
+  {
+    DocumentState* state; // 0 when the document is closed
+    int position;         // in state's document
+    QString fileName;
+    int line;             // 1-based
+    int column;           // 0-based
+  };
+
+  // like Emacs global-mark-ring-max
+  enum { MaxRecords = 16 };
+
+  // adds position unless the newest record is in the same document
+  void push(DocumentState* state, int position);
+  // the newest record, which moves to the back of the ring
+  bool pop(Location* location);
+  void documentClosed(DocumentState* state);
+  int count() const;
+  static GlobalMarkRing* instance();
+
+private:
+  struct Record
+  {
+    DocumentState* state;
+    int handle;
+    QString fileName;
+    int line;
+    int column;
+  };
+
+  void drop(const Record& record);
+
+  QVector<Record> records; // newest first
+};
+
+#endif // GLOBALMARKRING_H
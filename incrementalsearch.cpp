@@ -0,0 +1,415 @@
+#include "incrementalsearch.h"
+
+#include <QElapsedTimer>
+
+IncrementalSearch::IncrementalSearch(QObject* parent)
+  : QObject(parent)
+  , regexp(false)
+{
+  scanTimer.setSingleShot(true);
+  scanTimer.setInterval(0);
+  connect(&scanTimer, SIGNAL(timeout()), SLOT(scan()));
+}
+
+void IncrementalSearch::start(QTextDocument* document, int position, bool forward,
+    bool regexp)
+{
+  stop();
+  doc = document;
+  connect(doc, SIGNAL(contentsChange(int,int,int)), SLOT(documentChanged(int,int,int)));
+  this->regexp = regexp;
+  State state;
+  state.forward = forward;
+  state.found = false;
+  state.failed = false;
+  state.wrapped = false;
+  state.invalid = false;
+  state.cs = Qt::CaseInsensitive;
+  state.matchStart = position;
+  state.matchEnd = position;
+  const QTextBlock block = document->findBlock(position);
+  scanFrom(&state, block, position - block.position());
+  states.append(state);
+}
+
+void IncrementalSearch::stop()
+{
+  scanTimer.stop();
+  states.clear();
+  if (doc) {
+    disconnect(doc, 0, this, 0);
+  }
+  patterns.clear();
+}
+
+bool IncrementalSearch::isActive() const
+{
+  return !states.isEmpty();
+}
+
+void IncrementalSearch::setQuery(const QString& query)
+{
+  if (states.isEmpty() || !doc) {
+    return;
+  }
+  State state = states.last();
+  const bool extends = query.startsWith(state.query) && !state.query.isEmpty();
+  // a longer regexp may match more ("a" to "a|b"), only a longer string
+  // matches less
+  const bool narrows = extends && !regexp;
+  state.query = query;
+  state.invalid = false;
+  state.cs = caseSensitivity(query);
+  if (regexp && !query.isEmpty()) {
+    state.pattern = pattern(query, state.cs);
+  }
+  if (query.isEmpty()) {
+    // nothing to look for, stay where the search started
+    state = states.first();
+    state.forward = states.last().forward;
+  } else if (regexp && !state.pattern.regExp.isValid()) {
+    // typically half typed, like "foo(", wait for more
+    state.found = false;
+    state.failed = true;
+    state.invalid = true;
+  } else if (narrows && state.failed) {
+    // the shorter query is not there, the longer one cannot be either
+  } else if (narrows && state.found) {
+    // the longer string may still match where the shorter one did, a
+    // longer regexp may match nearer and starts over below
+    state.found = false;
+    state.failed = false;
+    const QTextBlock block = doc->findBlock(state.matchStart);
+    scanFrom(&state, block, state.matchStart - block.position());
+  } else if (!narrows) {
+    const State& first = states.first();
+    state.found = false;
+    state.failed = false;
+    state.blockStart = first.blockStart;
+    // backward the match has to start before point
+    state.offset = state.forward ? first.offset : first.offset - 1;
+  }
+  // extends a running scan: go on from where it is
+  push(state);
+}
+
+void IncrementalSearch::searchAgain(bool forward)
+{
+  if (states.isEmpty() || !doc) {
+    return;
+  }
+  if (states.last().query.isEmpty()) {
+    // only turns around, the next query searches that way
+    states.last().forward = forward;
+    return;
+  }
+  State state = states.last();
+  if (state.invalid) {
+    return;
+  }
+  if (state.failed && state.forward == forward) {
+    // wrap around
+    const QTextBlock block = forward ? doc->firstBlock() : doc->lastBlock();
+    scanFrom(&state, block, forward ? 0 : block.length());
+    state.wrapped = true;
+  } else if (state.forward != forward && (state.found || state.failed)) {
+    // turns around on the current match like Emacs, after a failure from
+    // the last match or where the search started; the scan of the failed
+    // state ran past the end and left nothing to go on from
+    const QTextBlock block = doc->findBlock(state.matchStart);
+    scanFrom(&state, block, state.matchStart - block.position());
+  } else if (state.found) {
+    const int from = forward ? qMax(state.matchEnd, state.matchStart + 1) : state.matchStart - 1;
+    const QTextBlock block = doc->findBlock(qMax(0, from));
+    scanFrom(&state, block, from - block.position());
+  } else if (!state.failed) {
+    return; // still looking
+  }
+  state.forward = forward;
+  state.found = false;
+  state.failed = false;
+  push(state);
+}
+
+bool IncrementalSearch::back()
+{
+  if (states.size() < 2) {
+    return false;
+  }
+  scanTimer.stop();
+  states.removeLast();
+  if (!states.last().found && !states.last().failed && !states.last().query.isEmpty()) {
+    startScan();
+  } else {
+    emit changed();
+  }
+  return true;
+}
+
+QString IncrementalSearch::query() const
+{
+  return states.isEmpty() ? QString() : states.last().query;
+}
+
+bool IncrementalSearch::isRegExp() const
+{
+  return regexp;
+}
+
+bool IncrementalSearch::isForward() const
+{
+  return states.isEmpty() || states.last().forward;
+}
+
+bool IncrementalSearch::isSearching() const
+{
+  return scanTimer.isActive();
+}
+
+bool IncrementalSearch::isFound() const
+{
+  return !states.isEmpty() && states.last().found;
+}
+
+bool IncrementalSearch::isFailed() const
+{
+  return !states.isEmpty() && states.last().failed;
+}
+
+bool IncrementalSearch::isWrapped() const
+{
+  return !states.isEmpty() && states.last().wrapped;
+}
+
+bool IncrementalSearch::isInvalid() const
+{
+  return !states.isEmpty() && states.last().invalid;
+}
+
+int IncrementalSearch::matchStart() const
+{
+  return states.isEmpty() ? 0 : states.last().matchStart;
+}
+
+int IncrementalSearch::matchEnd() const
+{
+  return states.isEmpty() ? 0 : states.last().matchEnd;
+}
+
+QVector<QPair<int, int> > IncrementalSearch::matches(const QTextBlock& first,
+    const QTextBlock& last) const
+{
+  QVector<QPair<int, int> > result;
+  const QString query = this->query();
+  if (query.isEmpty() || isInvalid()) {
+    return result;
+  }
+  for (QTextBlock block = first; block.isValid(); block = block.next()) {
+    const QString text = block.text();
+    int length = 0;
+    for (int i = find(text, 0, true, &length); i >= 0;
+        i = find(text, i + qMax(1, length), true, &length)) {
+      result.append(qMakePair(block.position() + i, block.position() + i + length));
+    }
+    if (block == last) {
+      break;
+    }
+  }
+  return result;
+}
+
+void IncrementalSearch::push(const State& state)
+{
+  scanTimer.stop();
+  // a state that is still scanning keeps its place for back()
+  states.append(state);
+  if (state.found || state.failed || state.query.isEmpty()) {
+    emit changed();
+  } else {
+    startScan();
+  }
+}
+
+/* The first slice runs at once, a query found nearby needs no timer */
+void IncrementalSearch::startScan()
+{
+  scan();
+}
+
+void IncrementalSearch::scan()
+{
+  if (states.isEmpty() || !doc) {
+    return;
+  }
+  State& state = states.last();
+  QElapsedTimer timer;
+  timer.start();
+  QTextBlock block;
+  if (state.blockStart >= 0) {
+    block = doc->findBlock(state.blockStart);
+    // an edit that joined blocks leaves blockStart inside one
+    state.offset += state.blockStart - block.position();
+  }
+  while (block.isValid()) {
+    const QString text = block.text();
+    int length = 0;
+    const int index = find(text, state.offset, state.forward, &length);
+    if (index >= 0) {
+      state.found = true;
+      state.matchStart = block.position() + index;
+      state.matchEnd = state.matchStart + length;
+      emit changed();
+      return;
+    }
+    block = state.forward ? block.next() : block.previous();
+    scanFrom(&state, block, state.forward ? 0 : block.length());
+    if (timer.elapsed() >= SliceMs) {
+      scanTimer.start();
+      return;
+    }
+  }
+  state.blockStart = -1;
+  state.failed = true;
+  emit changed();
+}
+
+void IncrementalSearch::scanFrom(State* state, const QTextBlock& block, int offset) const
+{
+  state->blockStart = block.isValid() ? block.position() : -1;
+  state->offset = offset;
+}
+
+/* Moves the positions of all states with the text, positions in removed
+ * text go to where it was. A running scan goes on from its new place. */
+void IncrementalSearch::documentChanged(int position, int removed, int added)
+{
+  const int end = position + removed;
+  for (int i = 0; i < states.size(); ++i) {
+    State& state = states[i];
+    int* positions[] = { &state.matchStart, &state.matchEnd, &state.blockStart };
+    for (int p = 0; p < 3; ++p) {
+      int& pos = *positions[p];
+      if (pos >= end) {
+        pos += added - removed;
+      } else if (pos > position) {
+        pos = position;
+      }
+    }
+  }
+}
+
+/* Index of the next match in text, starting at from forward or at most
+ * at from backward, -1 if there is none */
+int IncrementalSearch::find(const QString& text, int from, bool forward, int* length) const
+{
+  const State& state = states.last();
+  if (regexp) {
+    const Pattern& pattern = state.pattern;
+    const Qt::CaseSensitivity cs = state.cs;
+    from = qMin(from, text.size());
+    // forward a match from from on has the literal from there on, backward
+    // it may run past from
+    if (from < 0 || (!pattern.literal.isEmpty()
+        && text.indexOf(pattern.literal, forward ? from : 0, cs) < 0)) {
+      return -1;
+    }
+    const int index = forward ? pattern.regExp.indexIn(text, from)
+                              : pattern.regExp.lastIndexIn(text, from);
+    *length = pattern.regExp.matchedLength();
+    return index;
+  }
+  const QString& query = state.query;
+  *length = query.size();
+  if (forward) {
+    return from > text.size() ? -1 : text.indexOf(query, from, state.cs);
+  }
+  // QString::lastIndexOf gives up on from past the end
+  from = qMin(from, text.size() - query.size());
+  return from < 0 ? -1 : text.lastIndexOf(query, from, state.cs);
+}
+
+/* Like Emacs, an upper case letter in the query makes it case sensitive;
+ * in a regexp escapes like \W do not count */
+Qt::CaseSensitivity IncrementalSearch::caseSensitivity(const QString& query) const
+{
+  for (int i = 0; i < query.size(); ++i) {
+    if (regexp && query.at(i) == QLatin1Char('\\')) {
+      ++i;
+    } else if (query.at(i).isUpper()) {
+      return Qt::CaseSensitive;
+    }
+  }
+  return Qt::CaseInsensitive;
+}
+
+/* query compiled, asked once per query change; the state keeps the
+ * result for find(). DEL and retyping find the pattern in the cache. */
+IncrementalSearch::Pattern IncrementalSearch::pattern(const QString& query,
+    Qt::CaseSensitivity cs)
+{
+  const QString key = QLatin1Char(cs == Qt::CaseSensitive ? 'c' : 'i') + query;
+  QHash<QString, Pattern>::const_iterator it = patterns.constFind(key);
+  if (it == patterns.constEnd()) {
+    Pattern pattern;
+    pattern.regExp = QRegExp(query, cs, QRegExp::RegExp2);
+    pattern.literal = requiredLiteral(query);
+    it = patterns.insert(key, pattern);
+  }
+  return it.value();
+}
+
+/* The longest run of plain characters outside of groups and classes, one
+ * that every match has to contain. A character under a quantifier that
+ * allows none, or any alternation at top level, rules it out. Errs on the
+ * side of an empty literal, that only costs the prefilter. */
+QString IncrementalSearch::requiredLiteral(const QString& pattern)
+{
+  QString best;
+  QString run;
+  int depth = 0;
+  for (int i = 0; i < pattern.size(); ++i) {
+    const QChar c = pattern.at(i);
+    if (c == QLatin1Char('\\') && i + 1 < pattern.size()) {
+      const QChar escaped = pattern.at(++i);
+      if (depth == 0 && !escaped.isLetterOrNumber()) {
+        run += escaped;
+        continue;
+      }
+    } else if (c == QLatin1Char('(')) {
+      ++depth;
+    } else if (c == QLatin1Char(')')) {
+      depth = qMax(0, depth - 1);
+    } else if (c == QLatin1Char('|')) {
+      if (depth == 0) {
+        return QString();
+      }
+    } else if (c == QLatin1Char('[')) {
+      // a class, "[]...]" has the bracket as member
+      i += pattern.mid(i + 1, 2).startsWith(QLatin1String("^]")) ? 2
+           : pattern.mid(i + 1, 1) == QLatin1String("]") ? 1 : 0;
+      while (i + 1 < pattern.size() && pattern.at(i + 1) != QLatin1Char(']')) {
+        i += pattern.at(i + 1) == QLatin1Char('\\') ? 2 : 1;
+      }
+      ++i;
+    } else if (c == QLatin1Char('*') || c == QLatin1Char('?') || c == QLatin1Char('{')) {
+      // the character before may not be there at all
+      run.chop(1);
+      if (c == QLatin1Char('{')) {
+        while (i + 1 < pattern.size() && pattern.at(i) != QLatin1Char('}')) {
+          ++i;
+        }
+      }
+    } else if (c == QLatin1Char('+')) {
+      // it is there at least once, but what follows is not next to it
+    } else if (depth == 0 && c != QLatin1Char('.') && c != QLatin1Char('^')
+        && c != QLatin1Char('$')) {
+      run += c;
+      continue;
+    }
+    if (run.size() > best.size()) {
+      best = run;
+    }
+    run.clear();
+  }
+  return run.size() > best.size() ? run : best;
+}
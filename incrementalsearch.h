@@ -0,0 +1,112 @@
+#ifndef INCREMENTALSEARCH_H
+#define INCREMENTALSEARCH_H
+
+#include <QHash>
+#include <QObject>
+#include <QPair>
+#include <QPointer>
+#include <QRegExp>
+#include <QString>
+#include <QTextBlock>
+#include <QTextDocument>
+#include <QTimer>
+#include <QVector>
+
+/* The search behind isearch. Every query change or repeat pushes a state,
+ * DEL pops back to the previous one with its match. A query that extends
+ * the previous one goes on from its match, or from where its scan got so
+ * far: text already scanned without a match of the shorter query cannot
+ * hold the longer one. Scans run block by block in slices of SliceMs
+ * from a 0ms timer, so a search through a huge document never blocks
+ * typing; changed() tells about the outcome. States keep positions, not
+ * QTextBlocks: edits from elsewhere while the search runs shift them and
+ * every slice looks its block up again.
+ *
+ * In regexp mode patterns are compiled once per search and kept across
+ * keystrokes; each state holds its compiled pattern and case sensitivity,
+ * so the per block find() does no lookup. A literal run every match has to contain is taken from the
+ * pattern; blocks without it are skipped with a plain indexOf, and the
+ * pattern only runs on the blocks left. */
+class IncrementalSearch : public QObject
+{
+  Q_OBJECT
+
+public:
+  enum { SliceMs = 4 };
+
+  explicit IncrementalSearch(QObject* parent = 0);
+
+  // a new search from position, no query yet
+  void start(QTextDocument* document, int position, bool forward, bool regexp = false);
+  void stop();
+  bool isActive() const;
+
+  void setQuery(const QString& query);
+  // the next match in direction, after a failure from the other end; the
+  // other direction first turns around on the current match. Without a
+  // query yet just the direction
+  void searchAgain(bool forward);
+  // back to the state before the last setQuery or searchAgain
+  bool back();
+
+  QString query() const;
+  bool isRegExp() const;
+  bool isForward() const;
+  bool isSearching() const; // a scan is running
+  bool isFound() const;
+  bool isFailed() const;
+  bool isWrapped() const;
+  bool isInvalid() const; // a regexp that does not compile (yet)
+  int matchStart() const;
+  int matchEnd() const;
+
+  // all matches from block first to block last, for highlighting
+  QVector<QPair<int, int> > matches(const QTextBlock& first, const QTextBlock& last) const;
+
+signals:
+  void changed();
+
+private slots:
+  void scan();
+  void documentChanged(int position, int removed, int added);
+
+private:
+  struct Pattern
+  {
+    QRegExp regExp;
+    QString literal; // in every match, empty if nothing is certain
+  };
+
+  struct State
+  {
+    QString query;
+    bool forward;
+    bool found;
+    bool failed;
+    bool wrapped;
+    bool invalid;
+    int matchStart;
+    int matchEnd;
+    int blockStart; // block where the scan goes on, -1 past either end
+    int offset;     // in that block, start of the next candidate
+    Qt::CaseSensitivity cs; // of query
+    Pattern pattern; // query compiled, regexp mode only
+  };
+
+  void push(const State& state);
+  void scanFrom(State* state, const QTextBlock& block, int offset) const;
+  void startScan();
+  int find(const QString& text, int from, bool forward, int* length) const;
+  Qt::CaseSensitivity caseSensitivity(const QString& query) const;
+  Pattern pattern(const QString& query, Qt::CaseSensitivity cs);
+  static QString requiredLiteral(const QString& pattern);
+
+  QPointer<QTextDocument> doc;
+  QVector<State> states; // the last one is current
+  bool regexp;
+  // compiled patterns of this search, by case sensitivity and query
+  QHash<QString, Pattern> patterns;
+  QTimer scanTimer;
+};
+
+#endif // INCREMENTALSEARCH_H
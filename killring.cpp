@@ -1,14 +1,44 @@
 #include "killring.h"
+#include "sharedkillring.h"
 
 #include <QApplication>
 #include <QClipboard>
 #include <QDebug>
+#include <QFutureWatcher>
+#include <QHash>
+#include <QTextDocument>
+#include <QtConcurrentRun>
+
+static qint64 textBytes(const QString& text)
+{
+  return qint64(text.size()) * qint64(sizeof(QChar));
+}
+
+static QByteArray compressText(const QString& text)
+{
+  return qCompress(text.toUtf8());
+}
 
 KillRing::KillRing()
-  : currentView(0), iter(ring.begin()), ignore(false)
+  : totalBytes(0), maxEntries(60), maxBytes(Q_INT64_C(64) << 20), yankIndex(0),
+    nextId(0), useCount(0), shared(0), sharedSerial(0), selectionIngestion(false),
+    selectionId(-1), killSize(0), publishPending(false),
+    publishedHash(0), publishedSize(-1)
 {
   connect(QApplication::clipboard(), SIGNAL(dataChanged()), 
 	  SLOT(clipboardDataChanged()));
+  publishTimer.setSingleShot(true);
+  publishTimer.setInterval(0);
+  connect(&publishTimer, SIGNAL(timeout()), SLOT(publishClipboard()));
+  compressTimer.setSingleShot(true);
+  compressTimer.setInterval(CompressDelayMs);
+  connect(&compressTimer, SIGNAL(timeout()), SLOT(compressColdEntries()));
+  storeTimer.setSingleShot(true);
+  storeTimer.setInterval(StoreDelayMs);
+  connect(&storeTimer, SIGNAL(timeout()), SLOT(saveStore()));
+  selectionTimer.setSingleShot(true);
+  selectionTimer.setInterval(SelectionDelayMs);
+  connect(&selectionTimer, SIGNAL(timeout()), SLOT(commitSelection()));
 }
 
 KillRing* KillRing::instance()
@@ -20,59 +50,586 @@ KillRing* KillRing::instance()
   return instance;
 }
 
-void KillRing::ignoreNextClipboardChange()
+void KillRing::add(const QString& text)
 {
-  ignore = true;
+  if (text.isEmpty()) {
+    return;
+  }
+  insert(text);
+  schedulePublish(text);
 }
 
-void KillRing::add(const QString& text)
+/* New text from this process, goes to the shared ring as well */
+void KillRing::insert(const QString& text)
+{
+  if (shared) {
+    pullShared();
+    const quint32 serial = shared->add(text);
+    // nobody else added in between, the shared entry is the one we insert
+    if (serial == sharedSerial + 1) {
+      sharedSerial = serial;
+    }
+  }
+  insertLocal(text);
+}
+
+void KillRing::insertLocal(const QString& text)
+{
+  const uint hash = qHash(text);
+  // original emacs implementation does not remove duplicates
+  const int index = find(text, hash);
+  if (index >= 0) {
+    removeAt(index);
+  }
+  Entry entry;
+  entry.text = text;
+  entry.preview = text.left(text.indexOf(QLatin1Char('\n'))).left(80);
+  entry.hash = hash;
+  entry.bytes = textBytes(text);
+  entry.id = nextId++;
+  entry.lastUse = ++useCount;
+  entry.stored = false;
+  ring.prepend(entry);
+  ++hashCounts[hash];
+  totalBytes += entry.bytes;
+  trim();
+  yankIndex = 0;
+  compressTimer.start();
+  if (store.isOpen()) {
+    storeTimer.start();
+  }
+  emit changed();
+}
+
+QString KillRing::textOf(const Entry& entry) const
+{
+  if (!entry.compressed.isEmpty()) {
+    return QString::fromUtf8(qUncompress(entry.compressed));
+  }
+  if (entry.text.isNull() && entry.stored) {
+    return store.read(entry.slot);
+  }
+  return entry.text;
+}
+
+/* Text of the entry, decompressed and made hot again if needed */
+const QString& KillRing::textAt(int index)
+{
+  Entry& entry = ring[index];
+  if (entry.text.isNull()) {
+    entry.text = textOf(entry);
+    entry.compressed.clear();
+  }
+  entry.lastUse = ++useCount;
+  compressTimer.start();
+  return entry.text;
+}
+
+bool KillRing::isCold(const Entry& entry) const
+{
+  return entry.bytes >= CompressThreshold
+      && useCount - entry.lastUse >= ColdAfterUses;
+}
+
+void KillRing::compressColdEntries()
+{
+  for (int i = 0; i < ring.size(); ++i) {
+    Entry& entry = ring[i];
+    if (entry.text.isNull() || !isCold(entry)) {
+      continue;
+    }
+    if (entry.stored) {
+      entry.text = QString(); // the store has it
+      continue;
+    }
+    if (compressingIds.contains(entry.id)) {
+      continue;
+    }
+    QFutureWatcher<QByteArray>* watcher = new QFutureWatcher<QByteArray>(this);
+    connect(watcher, SIGNAL(finished()), SLOT(compressionFinished()));
+    compressJobs.insert(watcher, entry.id);
+    compressingIds.insert(entry.id);
+    watcher->setFuture(QtConcurrent::run(compressText, entry.text));
+  }
+}
+
+/* The entry may have been yanked or dropped while the worker ran, then
+ * the result is thrown away. */
+void KillRing::compressionFinished()
+{
+  QFutureWatcher<QByteArray>* watcher =
+      static_cast<QFutureWatcher<QByteArray>*>(sender());
+  const int id = compressJobs.take(watcher);
+  compressingIds.remove(id);
+  const QByteArray compressed = watcher->result();
+  watcher->deleteLater();
+
+  for (int i = 0; i < ring.size(); ++i) {
+    Entry& entry = ring[i];
+    if (entry.id != id) {
+      continue;
+    }
+    if (!entry.text.isNull() && isCold(entry)
+        && compressed.size() < entry.bytes) {
+      entry.compressed = compressed;
+      entry.text = QString();
+    }
+    break;
+  }
+}
+
+int KillRing::find(const QString& text, uint hash) const
+{
+  if (!hashCounts.contains(hash)) {
+    return -1;
+  }
+  for (int i = 0; i < ring.size(); ++i) {
+    const Entry& entry = ring.at(i);
+    if (entry.hash == hash && entry.bytes == textBytes(text)
+        && textOf(entry) == text) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+void KillRing::removeAt(int index)
+{
+  const Entry& entry = ring.at(index);
+  QHash<uint, int>::iterator it = hashCounts.find(entry.hash);
+  if (--it.value() == 0) {
+    hashCounts.erase(it);
+  }
+  totalBytes -= entry.bytes;
+  ring.removeAt(index);
+  if (store.isOpen()) {
+    storeTimer.start();
+  }
+}
+
+/* Drops old entries until both limits hold. Over the byte budget the
+ * oldest entry that alone covers the excess goes, so one huge kill does
+ * not push out many small ones; failing that the oldest entry. */
+void KillRing::trim()
+{
+  while (ring.size() > maxEntries && ring.size() > 1) {
+    removeAt(ring.size() - 1);
+  }
+  while (totalBytes > maxBytes && ring.size() > 1) {
+    const qint64 excess = totalBytes - maxBytes;
+    int victim = ring.size() - 1;
+    for (int i = ring.size() - 1; i > 0; --i) {
+      if (ring.at(i).bytes >= excess) {
+        victim = i;
+        break;
+      }
+    }
+    removeAt(victim);
+  }
+  if (yankIndex >= ring.size()) {
+    yankIndex = 0;
+  }
+}
+
+void KillRing::setMaxEntries(int entries)
+{
+  maxEntries = qMax(1, entries);
+  trim();
+  emit changed();
+}
+
+void KillRing::setMaxBytes(qint64 bytes)
+{
+  maxBytes = qMax(qint64(0), bytes);
+  trim();
+  emit changed();
+}
+
+int KillRing::count() const
+{
+  return ring.size();
+}
+
+qint64 KillRing::bytes() const
+{
+  return totalBytes;
+}
+
+qint64 KillRing::residentBytes() const
+{
+  qint64 resident = 0;
+  foreach (const Entry& entry, ring) {
+    if (!entry.compressed.isEmpty()) {
+      resident += entry.compressed.size();
+    } else if (!entry.text.isNull()) {
+      resident += entry.bytes;
+    }
+  }
+  return resident;
+}
+
+int KillRing::entryId(int index) const
+{
+  return ring.at(index).id;
+}
+
+int KillRing::indexOfEntry(int id) const
+{
+  for (int i = 0; i < ring.size(); ++i) {
+    if (ring.at(i).id == id) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+QString KillRing::yankEntryText(int id)
+{
+  const int index = indexOfEntry(id);
+  if (index < 0) {
+    return QString();
+  }
+  yankIndex = index;
+  return textAt(yankIndex);
+}
+
+QString KillRing::preview(int index) const
+{
+  const Entry& entry = ring.at(index);
+  if (entry.preview.isNull() && entry.stored) {
+    const QString text = store.readPrefix(entry.slot, 320);
+    return text.left(text.indexOf(QLatin1Char('\n'))).left(80);
+  }
+  return entry.preview;
+}
+
+QString KillRing::sharedText(const QString& text) const
+{
+  const int index = find(text, qHash(text));
+  if (index >= 0 && !ring.at(index).text.isNull()) {
+    return ring.at(index).text;
+  }
+  return text;
+}
+
+bool KillRing::setSharedKey(const QString& key)
+{
+  delete shared;
+  shared = 0;
+  sharedSerial = 0;
+  if (key.isEmpty()) {
+    return true;
+  }
+  shared = new SharedKillRing;
+  if (!shared->attach(key)) {
+    qWarning() << "KillRing: cannot attach shared ring" << key;
+    delete shared;
+    shared = 0;
+    return false;
+  }
+  pullShared();
+  return true;
+}
+
+bool KillRing::isShared() const
+{
+  return shared != 0;
+}
+
+/* Adds what other processes put into the shared ring since the last pull */
+void KillRing::pullShared()
+{
+  if (!shared || shared->lastSerial() == sharedSerial) {
+    return;
+  }
+  if (shared->lastSerial() < sharedSerial) {
+    sharedSerial = 0; // the segment was created anew
+  }
+  foreach (const SharedKillRing::Item& item, shared->itemsSince(sharedSerial)) {
+    insertLocal(item.text);
+    sharedSerial = item.serial;
+  }
+}
+
+bool KillRing::setStoreDirectory(const QString& directory)
+{
+  sync();
+  // entries only the old store has come back into memory
+  for (int i = 0; i < ring.size(); ++i) {
+    Entry& entry = ring[i];
+    if (entry.text.isNull() && entry.compressed.isEmpty()) {
+      entry.text = textOf(entry);
+    }
+    entry.stored = false;
+  }
+  store.close();
+  if (!store.open(directory)) {
+    // or another instance has it, this one keeps its ring in memory
+    qWarning() << "KillRing: cannot open store in" << directory;
+    return false;
+  }
+
+  // after a Qt upgrade the stored hashes are another qHash's, reading the
+  // texts once to hash them anew is the price of keeping the entries
+  const bool hashesValid = store.hashesValid();
+  foreach (KillRingStore::Slot slot, store.committed()) {
+    if (!hashesValid) {
+      const QString text = store.read(slot);
+      if (text.isNull()) {
+        continue;
+      }
+      slot.hash = qHash(text);
+    }
+    Entry entry;
+    entry.hash = slot.hash;
+    entry.bytes = qint64(slot.length) * qint64(sizeof(QChar));
+    // the same text was killed again in this session; only then is the
+    // text read, a hash alone may belong to a different text
+    if (hashCounts.contains(entry.hash)) {
+      const QString text = store.read(slot);
+      if (text.isNull() || find(text, entry.hash) >= 0) {
+        continue;
+      }
+    }
+    entry.id = nextId++;
+    entry.lastUse = 0;
+    entry.stored = true;
+    entry.slot = slot;
+    ring.append(entry);
+    ++hashCounts[entry.hash];
+    totalBytes += entry.bytes;
+  }
+  trim();
+  storeTimer.start();
+  emit changed();
+  return true;
+}
+
+void KillRing::sync()
+{
+  if (storeTimer.isActive()) {
+    saveStore();
+  }
+}
+
+/* Appends new entries to the store and commits the ring order */
+void KillRing::saveStore()
+{
+  storeTimer.stop();
+  if (!store.isOpen()) {
+    return;
+  }
+  QVector<KillRingStore::Slot> slotList;
+  qint64 liveBytes = 0;
+  for (int i = 0; i < ring.size() && i < KillRingStore::MaxSlots; ++i) {
+    Entry& entry = ring[i];
+    if (!entry.stored) {
+      if (!store.append(textOf(entry), &entry.slot)) {
+        qWarning() << "KillRing: cannot write store";
+        return;
+      }
+      entry.stored = true;
+    }
+    slotList.append(entry.slot);
+    liveBytes += entry.slot.size;
+  }
+  store.writeIndex(slotList);
+
+  if (store.dataSize() > CompactMinBytes && store.dataSize() > 2 * liveBytes
+      && store.compact(&slotList)) {
+    for (int i = 0; i < slotList.size(); ++i) {
+      ring[i].slot = slotList.at(i);
+    }
+  }
+}
+
+void KillRing::kill(const QString& text, bool prepend)
 {
   if (text.isEmpty()) {
     return;
   }
-  if (ignore) {
-    ignore = false;
+  if (prepend) {
+    killPrepends.append(text);
+  } else {
+    killAppends.append(text);
+  }
+  killSize += text.size();
+}
+
+void KillRing::endKill()
+{
+  if (!isKilling()) {
     return;
   }
+  QString text;
+  text.reserve(killSize);
+  for (int i = killPrepends.size() - 1; i >= 0; --i) {
+    text += killPrepends.at(i);
+  }
+  foreach (const QString& piece, killAppends) {
+    text += piece;
+  }
+  killPrepends.clear();
+  killAppends.clear();
+  killSize = 0;
 
-  // original emacs implementation does not remove duplicates
-  ring.removeAll(text);
-  ring.prepend(text);
-  // shrink ring to default emacs max size
-  while (ring.count() > 60) {
-    ring.pop_back();
+  insert(text);
+  schedulePublish(text);
+}
+
+bool KillRing::isKilling() const
+{
+  return killSize > 0;
+}
+
+QString KillRing::yankText(int index)
+{
+  pullShared();
+  QClipboard* clipboard = QApplication::clipboard();
+  if (!publishPending && !clipboard->ownsClipboard()) {
+    const QString text(clipboard->text());
+    const uint hash = qHash(text);
+    const bool known = !ring.isEmpty() && ring.at(0).hash == hash
+        && ring.at(0).bytes == textBytes(text);
+    if (!text.isEmpty() && !known
+        && !(text.size() == publishedSize && hash == publishedHash)) {
+      insert(text);
+    }
   }
-  iter = ring.begin();
+  if (ring.isEmpty()) {
+    return QString();
+  }
+  yankIndex = qBound(0, index, ring.size() - 1);
+  return textAt(yankIndex);
 }
 
 QString KillRing::next()
 {
+  pullShared();
+  if (ring.isEmpty()) {
+    return QString::null;
+  }
+  else if (++yankIndex >= ring.size()) {
+    yankIndex = 0;
+  }
+  return textAt(yankIndex);
+}
+
+QString KillRing::previous()
+{
+  pullShared();
   if (ring.isEmpty()) {
     return QString::null;
   }
-  else if (++iter == ring.end()) {
-    iter = ring.begin();
+  else if (--yankIndex < 0) {
+    yankIndex = ring.size() - 1;
+  }
+  return textAt(yankIndex);
+}
+
+void KillRing::publishYank()
+{
+  if (yankIndex >= 0 && yankIndex < ring.size()) {
+    schedulePublish(textAt(yankIndex));
+  }
+}
+
+/* Only the last text scheduled in an event loop turn reaches the
+ * clipboard, a kill never waits for the clipboard owner. */
+void KillRing::schedulePublish(const QString& text)
+{
+  pendingText = text;
+  publishPending = true;
+  if (!publishTimer.isActive()) {
+    publishTimer.start();
+  }
+}
+
+void KillRing::publishClipboard()
+{
+  if (!publishPending) {
+    return;
+  }
+  publishPending = false;
+  publishTimer.stop();
+  publishedHash = qHash(pendingText);
+  publishedSize = pendingText.size();
+  QApplication::clipboard()->setText(pendingText);
+  pendingText.clear();
+}
+
+void KillRing::flushClipboard()
+{
+  publishClipboard();
+}
+
+void KillRing::setCurrentYankDocument(QTextDocument* document)
+{
+  currentDocument = document;
+}
+
+QTextDocument* KillRing::currentYankDocument() const
+{
+  return currentDocument;
+}
+
+void KillRing::setSelectionIngestion(bool on)
+{
+  QClipboard* clipboard = QApplication::clipboard();
+  if (on == selectionIngestion || (on && !clipboard->supportsSelection())) {
+    return;
+  }
+  selectionIngestion = on;
+  if (on) {
+    connect(clipboard, SIGNAL(selectionChanged()), SLOT(selectionDataChanged()));
+  } else {
+    disconnect(clipboard, SIGNAL(selectionChanged()), this, SLOT(selectionDataChanged()));
+    selectionTimer.stop();
   }
-  KillRing::instance()->ignoreNextClipboardChange();
-  QApplication::clipboard()->setText(*iter);
-  return *iter;
 }
 
-void KillRing::setCurrentYankView(QWidget* view)
+/* Runs for every step of a mouse drag, so it only restarts the timer and
+ * does not even read the selection. */
+void KillRing::selectionDataChanged()
 {
-  currentView = view;
+  selectionTimer.start();
 }
 
-QWidget* KillRing::currentYankView() const
+void KillRing::commitSelection()
 {
-  return currentView;
+  // still dragging in one of our windows
+  if (QApplication::mouseButtons() != Qt::NoButton) {
+    selectionTimer.start();
+    return;
+  }
+  const QString text(QApplication::clipboard()->text(QClipboard::Selection));
+  if (text.isEmpty()) {
+    return;
+  }
+  // the selection grew at either end since the last one was taken
+  if (!ring.isEmpty() && ring.at(0).id == selectionId) {
+    const QString previous = textOf(ring.at(0));
+    if (text == previous) {
+      return;
+    }
+    if (text.startsWith(previous) || text.endsWith(previous)) {
+      removeAt(0);
+    }
+  }
+  insert(text);
+  selectionId = ring.isEmpty() ? -1 : ring.at(0).id;
 }
 
 void KillRing::clipboardDataChanged()
 {
 	//qDebug() << "clipboard changed " << QApplication::clipboard()->text()
 	//    << endl;
-  // TODO handle mouse selection too, optionally
   QString text(QApplication::clipboard()->text());
-  add(text);
+  if (text.isEmpty()) {
+    return;
+  }
+  if (text.size() == publishedSize && qHash(text) == publishedHash) {
+    return; // our own publishClipboard
+  }
+  insert(text);
 }
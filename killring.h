@@ -1,32 +1,168 @@
 #ifndef KILLRING_H
 #define KILLRING_H
 
+#include <QByteArray>
+#include <QHash>
+#include <QList>
 #include <QObject>
+#include <QPointer>
+#include <QSet>
 #include <QStringList>
+#include <QTimer>
 
-class QWidget;
+#include "killringstore.h"
 
+class SharedKillRing;
+
+class QTextDocument;
+
+/* The kill ring is the source of truth for killed text. The system
+ * clipboard follows it asynchronously, at most once per event loop turn,
+ * and changes made by others are added to the ring. */
 class KillRing : public QObject
 {
   Q_OBJECT
 
 public:
   KillRing();
-  void setCurrentYankView(QWidget* view);
-  QWidget* currentYankView() const;
+  // the document of the last yank, all its views may M-y after it
+  void setCurrentYankDocument(QTextDocument* document);
+  QTextDocument* currentYankDocument() const;
+  // adds text as the newest entry, like kill-ring-save
   void add(const QString& text);
+  // the entry after the one last yanked; the clipboard is left alone
+  // until publishYank, M-y may only be showing it
   QString next();
-  void ignoreNextClipboardChange();
+  // the entry before the one last yanked, for M-y with a negative count
+  QString previous();
+  // puts the entry of the last next() or previous() on the clipboard
+  void publishYank();
+  // the entry to yank, index entries back from the newest; the clipboard
+  // is read only when another application owns it
+  QString yankText(int index = 0);
+  // consecutive kills are collected here and become one ring entry,
+  // published to the clipboard once, when endKill ends the sequence
+  void kill(const QString& text, bool prepend = false);
+  void endKill();
+  bool isKilling() const;
+  // the ring keeps at most maxEntries entries and maxBytes of text, the
+  // newest entry is kept even when it alone is larger
+  void setMaxEntries(int maxEntries);
+  void setMaxBytes(qint64 maxBytes);
+  int count() const;
+  qint64 bytes() const;
+  // memory actually held, compressed entries count with their packed size
+  qint64 residentBytes() const;
+  // first line of an entry, available without decompressing it
+  QString preview(int index) const;
+  // id of an entry, it stays with the entry while others come and go
+  int entryId(int index) const;
+  // index of the entry with id, -1 when it is gone
+  int indexOfEntry(int id) const;
+  // the entry with id to yank, null when it is gone; unlike yankText
+  // nothing is taken from the clipboard or the shared ring first
+  QString yankEntryText(int id);
+  // the ring's copy of text when a resident entry has the same text, so
+  // that keeping text elsewhere does not store it twice
+  QString sharedText(const QString& text) const;
+  // sets a pending clipboard update now, for code that reads the clipboard
+  void flushClipboard();
+  // keeps the ring in a KillRingStore in directory, entries stored there
+  // before are added behind the current ones and loaded when used. They
+  // count against the limits like any other entry, so set those first:
+  // the store only holds what the ring held, at most MaxSlots entries
+  bool setStoreDirectory(const QString& directory);
+  // writes changes to the store now instead of after StoreDelayMs
+  void sync();
+  // shares the ring with all processes using the same key through shared
+  // memory, an empty key stops sharing
+  bool setSharedKey(const QString& key);
+  bool isShared() const;
+  // also adds the mouse selection (X11 PRIMARY) once it stopped changing,
+  // a selection that extends the previous one replaces it
+  void setSelectionIngestion(bool on);
   static KillRing* instance();
 
+signals:
+  // entries were added, removed or reordered
+  void changed();
+
 private slots:
   void clipboardDataChanged();
+  void selectionDataChanged();
+  void commitSelection();
+  void publishClipboard();
+  void compressColdEntries();
+  void compressionFinished();
+  void saveStore();
 
 private:
-  QStringList ring;
-  QWidget* currentView;
-  QStringList::ConstIterator iter;
-  bool ignore;
+  /* Entries of at least CompressThreshold bytes that were not used in the
+   * last ColdAfterUses inserts and yanks are compressed in a worker
+   * thread, or just dropped from memory when the store has them. text is
+   * then null until a yank needs it again. */
+  enum { CompressThreshold = 64 * 1024, ColdAfterUses = 8, CompressDelayMs = 2000 };
+  // the store is compacted when less than half of its data is live
+  enum { StoreDelayMs = 500, CompactMinBytes = 1024 * 1024 };
+  // a selection is taken when it did not change for SelectionDelayMs
+  enum { SelectionDelayMs = 400 };
+
+  struct Entry
+  {
+    QString text;
+    QByteArray compressed;
+    QString preview;
+    uint hash;
+    qint64 bytes;
+    int id;
+    int lastUse;
+    bool stored; // slot is committed to the store
+    KillRingStore::Slot slot;
+  };
+
+  void insert(const QString& text);
+  void insertLocal(const QString& text);
+  void pullShared();
+  const QString& textAt(int index);
+  QString textOf(const Entry& entry) const;
+  bool isCold(const Entry& entry) const;
+  int find(const QString& text, uint hash) const;
+  void removeAt(int index);
+  void trim();
+  void schedulePublish(const QString& text);
+
+  QList<Entry> ring; // newest first
+  // number of entries per content hash, most texts are not in the ring
+  // and need no comparison at all
+  QHash<uint, int> hashCounts;
+  qint64 totalBytes;
+  int maxEntries;
+  qint64 maxBytes;
+  int yankIndex; // entry returned by the last next()
+  int nextId;
+  int useCount; // inserts and yanks so far, for Entry::lastUse
+  QTimer compressTimer;
+  QHash<QObject*, int> compressJobs; // running watcher -> entry id
+  QSet<int> compressingIds;          // the ids in compressJobs
+  KillRingStore store;
+  QTimer storeTimer;
+  SharedKillRing* shared;
+  quint32 sharedSerial; // newest shared entry already in ring
+  bool selectionIngestion;
+  QTimer selectionTimer;
+  int selectionId; // id of the entry added from the last selection
+  QStringList killAppends;  // text appended to the current kill
+  QStringList killPrepends; // text prepended to it, most recent last
+  int killSize;
+  QPointer<QTextDocument> currentDocument;
+  // clipboard text waiting for publishClipboard
+  QString pendingText;
+  bool publishPending;
+  QTimer publishTimer;
+  // content token of the text we put on the clipboard last, so the
+  // dataChanged it causes is not added to the ring a second time
+  uint publishedHash;
+  int publishedSize;
 };
 
 #endif
@@ -0,0 +1,219 @@
+#include "killringbrowser.h"
+#include "killring.h"
+
+#include <QKeyEvent>
+#include <QLineEdit>
+#include <QListView>
+#include <QVBoxLayout>
+
+KillRingModel::KillRingModel(KillRing* killRing, QObject* parent)
+  : QAbstractListModel(parent), ring(killRing)
+{
+  connect(ring, SIGNAL(changed()), SLOT(ringChanged()));
+  ringChanged();
+}
+
+int KillRingModel::rowCount(const QModelIndex& parent) const
+{
+  return parent.isValid() ? 0 : rows.size();
+}
+
+QVariant KillRingModel::data(const QModelIndex& index, int role) const
+{
+  if (role != Qt::DisplayRole || !index.isValid() || index.row() >= rows.size()) {
+    return QVariant();
+  }
+  return previewOf(rows.at(index.row()));
+}
+
+int KillRingModel::entryId(int row) const
+{
+  return row >= 0 && row < rows.size() ? rows.at(row) : -1;
+}
+
+void KillRingModel::setFilter(const QString& filter)
+{
+  if (filter == filterText) {
+    return;
+  }
+  const bool narrows = filter.startsWith(filterText);
+  filterText = filter;
+  beginResetModel();
+  if (narrows) {
+    // everything the longer query matches was matched before
+    int kept = 0;
+    for (int i = 0; i < rows.size(); ++i) {
+      if (matches(previewOf(rows.at(i)), filterText)) {
+        rows[kept++] = rows.at(i);
+      }
+    }
+    rows.resize(kept);
+  } else {
+    rows.clear();
+    for (int i = 0; i < ring->count(); ++i) {
+      if (matches(previewAt(i), filterText)) {
+        rows.append(ring->entryId(i));
+      }
+    }
+  }
+  endResetModel();
+}
+
+/* Entries came or went, matches start over; the previews of entries
+ * still there stay */
+void KillRingModel::ringChanged()
+{
+  beginResetModel();
+  const QHash<int, QString> known = previews;
+  previews.clear();
+  rows.clear();
+  for (int i = 0; i < ring->count(); ++i) {
+    const int id = ring->entryId(i);
+    QHash<int, QString>::const_iterator it = known.constFind(id);
+    if (it != known.constEnd()) {
+      previews.insert(id, it.value());
+    }
+    if (filterText.isEmpty() || matches(previewAt(i), filterText)) {
+      rows.append(id);
+    }
+  }
+  endResetModel();
+}
+
+bool KillRingModel::matches(const QString& text, const QString& filter)
+{
+  int from = 0;
+  foreach (const QChar& c, filter) {
+    from = text.indexOf(c, from, Qt::CaseInsensitive);
+    if (from < 0) {
+      return false;
+    }
+    ++from;
+  }
+  return true;
+}
+
+// preview of the entry at a ring index
+const QString& KillRingModel::previewAt(int index) const
+{
+  QString& preview = previews[ring->entryId(index)];
+  if (preview.isNull()) {
+    preview = ring->preview(index);
+    if (preview.isNull()) {
+      preview = QLatin1String("");
+    }
+  }
+  return preview;
+}
+
+// preview of the entry with id, empty when it is gone
+const QString& KillRingModel::previewOf(int id) const
+{
+  static const QString none = QLatin1String("");
+  QHash<int, QString>::const_iterator it = previews.constFind(id);
+  if (it != previews.constEnd()) {
+    return it.value();
+  }
+  const int index = ring->indexOfEntry(id);
+  return index < 0 ? none : previewAt(index);
+}
+
+KillRingBrowser::KillRingBrowser(QWidget* parent)
+  : QFrame(parent, Qt::Popup)
+{
+  setAttribute(Qt::WA_DeleteOnClose);
+  setFrameShape(QFrame::StyledPanel);
+
+  model = new KillRingModel(KillRing::instance(), this);
+  filterEdit = new QLineEdit(this);
+  list = new QListView(this);
+  list->setModel(model);
+  // all rows have the same height, the view does not measure each one
+  list->setUniformItemSizes(true);
+  list->setFocusPolicy(Qt::NoFocus);
+  if (model->rowCount() > 0) {
+    list->setCurrentIndex(model->index(0));
+  }
+
+  QVBoxLayout* layout = new QVBoxLayout(this);
+  layout->setContentsMargins(2, 2, 2, 2);
+  layout->setSpacing(2);
+  layout->addWidget(filterEdit);
+  layout->addWidget(list);
+  resize(480, 320);
+
+  filterEdit->installEventFilter(this);
+  connect(filterEdit, SIGNAL(textChanged(QString)), SLOT(filterChanged(QString)));
+  connect(filterEdit, SIGNAL(returnPressed()), SLOT(choose()));
+  connect(list, SIGNAL(activated(QModelIndex)), SLOT(choose()));
+  setFocusProxy(filterEdit);
+}
+
+void KillRingBrowser::filterChanged(const QString& filter)
+{
+  model->setFilter(filter);
+  if (model->rowCount() > 0) {
+    list->setCurrentIndex(model->index(0));
+  }
+}
+
+void KillRingBrowser::choose()
+{
+  const int id = model->entryId(list->currentIndex().row());
+  close();
+  if (id >= 0) {
+    emit entryChosen(id);
+  }
+}
+
+void KillRingBrowser::moveCurrent(int rows)
+{
+  const int count = model->rowCount();
+  if (count == 0) {
+    return;
+  }
+  const int row = qBound(0, list->currentIndex().row() + rows, count - 1);
+  list->setCurrentIndex(model->index(row));
+}
+
+bool KillRingBrowser::eventFilter(QObject* object, QEvent* event)
+{
+  if (object != filterEdit || event->type() != QEvent::KeyPress) {
+    return QFrame::eventFilter(object, event);
+  }
+  QKeyEvent* keyEvent = static_cast<QKeyEvent*>(event);
+  const bool control = keyEvent->modifiers() & Qt::ControlModifier;
+  switch (keyEvent->key()) {
+  case Qt::Key_Down:
+    moveCurrent(1);
+    return true;
+  case Qt::Key_Up:
+    moveCurrent(-1);
+    return true;
+  case Qt::Key_PageDown:
+    moveCurrent(10);
+    return true;
+  case Qt::Key_PageUp:
+    moveCurrent(-10);
+    return true;
+  case Qt::Key_N:
+    if (control) {
+      moveCurrent(1);
+      return true;
+    }
+    break;
+  case Qt::Key_P:
+    if (control) {
+      moveCurrent(-1);
+      return true;
+    }
+    break;
+  case Qt::Key_G:
+    if (control) {
+      close();
+      return true;
+    }
+    break;
+  }
+  return QFrame::eventFilter(object, event);
+}
@@ -0,0 +1,77 @@
+#ifndef KILLRINGBROWSER_H
+#define KILLRINGBROWSER_H
+
+#include <QAbstractListModel>
+#include <QFrame>
+#include <QHash>
+#include <QString>
+#include <QVector>
+
+class KillRing;
+
+class QLineEdit;
+class QListView;
+
+/* The kill ring as a list of first lines. The view asks only for the rows
+ * it shows, so opening costs nothing per entry and no entry text is ever
+ * copied. Rows hold entry ids, which unlike ring indexes do not shift
+ * when entries come in from the clipboard or other instances. The filter
+ * keeps the matching ids; a query that extends the previous one only
+ * rechecks those. */
+class KillRingModel : public QAbstractListModel
+{
+  Q_OBJECT
+
+public:
+  explicit KillRingModel(KillRing* ring, QObject* parent = 0);
+
+  int rowCount(const QModelIndex& parent = QModelIndex()) const;
+  QVariant data(const QModelIndex& index, int role = Qt::DisplayRole) const;
+
+  // kill ring entry id of a row, -1 when there is none
+  int entryId(int row) const;
+  // shows the entries whose first line contains the characters of
+  // filter in this order, ignoring case
+  void setFilter(const QString& filter);
+
+private slots:
+  void ringChanged();
+
+private:
+  static bool matches(const QString& text, const QString& filter);
+  const QString& previewAt(int index) const;
+  const QString& previewOf(int id) const;
+
+  KillRing* ring;
+  QString filterText;
+  QVector<int> rows; // ids of the matching entries, newest first
+  mutable QHash<int, QString> previews; // loaded on first use, per id
+};
+
+/* Popup with a filter line above the kill ring list. Typing filters,
+ * C-n/C-p and the arrows move, Return chooses and Escape closes. */
+class KillRingBrowser : public QFrame
+{
+  Q_OBJECT
+
+public:
+  explicit KillRingBrowser(QWidget* parent = 0);
+
+signals:
+  // id of the chosen kill ring entry, see KillRing::yankEntryText
+  void entryChosen(int id);
+
+private slots:
+  void filterChanged(const QString& filter);
+  void choose();
+
+private:
+  bool eventFilter(QObject* object, QEvent* event);
+  void moveCurrent(int rows);
+
+  KillRingModel* model;
+  QLineEdit* filterEdit;
+  QListView* list;
+};
+
+#endif // KILLRINGBROWSER_H
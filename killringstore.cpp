@@ -0,0 +1,424 @@
+#include "killringstore.h"
+
+#include <QDir>
+#include <QFileInfo>
+#include <QHash>
+#include <QStringList>
+
+#include <cstdio>
+#include <cstring>
+
+#ifdef Q_OS_WIN
+#include <io.h>
+#include <windows.h>
+#else
+#include <sys/file.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static const quint32 Magic = 0x524b4b45; // "EKKR"
+static const quint32 Version = 2;
+
+KillRingStore::KillRingStore()
+  : index(0), data(0), dataMapped(0), dataEnd(0), generation(0)
+{
+}
+
+KillRingStore::~KillRingStore()
+{
+  close();
+}
+
+QString KillRingStore::dataFileName(quint32 number) const
+{
+  return dir + QString::fromLatin1("/killring-%1.dat").arg(number);
+}
+
+QString KillRingStore::indexFileName() const
+{
+  return dir + QLatin1String("/killring.idx");
+}
+
+bool KillRingStore::open(const QString& directory)
+{
+  close();
+  if (!QDir().mkpath(directory)) {
+    return false;
+  }
+  dir = directory;
+  if (!lockDirectory() || !openFiles()) {
+    close();
+    return false;
+  }
+  return true;
+}
+
+/* A second instance opening the store would truncate the uncommitted
+ * appends of the first, write to the same index slots and remove files
+ * the first still has mapped. The lock is an OS lock on killring.lock,
+ * released when the file is closed or its process dies, so a crashed
+ * owner never leaves it stale. */
+bool KillRingStore::lockDirectory()
+{
+  lockFile.setFileName(dir + QLatin1String("/killring.lock"));
+  if (!lockFile.open(QIODevice::ReadWrite)) {
+    return false;
+  }
+#ifdef Q_OS_WIN
+  OVERLAPPED overlapped;
+  std::memset(&overlapped, 0, sizeof(overlapped));
+  const HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(lockFile.handle()));
+  if (LockFileEx(handle, LOCKFILE_EXCLUSIVE_LOCK | LOCKFILE_FAIL_IMMEDIATELY,
+                 0, 1, 0, &overlapped)) {
+    return true;
+  }
+#else
+  if (flock(lockFile.handle(), LOCK_EX | LOCK_NB) == 0) {
+    return true;
+  }
+#endif
+  lockFile.close();
+  return false;
+}
+
+bool KillRingStore::openFiles()
+{
+  // a compaction that died before its rename left the new index behind
+  const QString tmpIndex = indexFileName() + QLatin1String(".tmp");
+  if (!QFile::exists(indexFileName()) && QFile::exists(tmpIndex)) {
+    replaceFile(tmpIndex, indexFileName());
+  }
+
+  indexFile.setFileName(indexFileName());
+  if (!indexFile.open(QIODevice::ReadWrite) || !mapIndex()) {
+    closeFiles();
+    return false;
+  }
+  Header* header = reinterpret_cast<Header*>(index);
+  if (header->magic != Magic || header->version != Version
+      || header->count > MaxSlots) {
+    std::memset(index, 0, indexFile.size());
+    header->magic = Magic;
+    header->version = Version;
+  }
+
+  generation = header->generation;
+  dataFile.setFileName(dataFileName(generation));
+  if (!dataFile.open(QIODevice::ReadWrite)) {
+    closeFiles();
+    return false;
+  }
+  // drop whatever was written after the last commit
+  if (quint64(dataFile.size()) > header->dataSize) {
+    dataFile.resize(header->dataSize);
+  } else if (quint64(dataFile.size()) < header->dataSize) {
+    header->dataSize = dataFile.size();
+    header->count = 0;
+  }
+  dataEnd = header->dataSize;
+  removeStaleFiles();
+  return true;
+}
+
+bool KillRingStore::mapIndex()
+{
+  const qint64 size = sizeof(Header) + qint64(MaxSlots) * sizeof(Slot);
+  if (indexFile.size() != size && !indexFile.resize(size)) {
+    return false;
+  }
+  index = indexFile.map(0, size);
+  return index != 0;
+}
+
+void KillRingStore::close()
+{
+  closeFiles();
+  // closing the handle releases the lock
+  lockFile.close();
+}
+
+void KillRingStore::closeFiles()
+{
+  if (index) {
+    indexFile.unmap(index);
+    index = 0;
+  }
+  indexFile.close();
+  if (data) {
+    dataFile.unmap(data);
+    data = 0;
+  }
+  dataMapped = 0;
+  dataFile.close();
+  dataEnd = 0;
+}
+
+bool KillRingStore::isOpen() const
+{
+  return index != 0;
+}
+
+bool KillRingStore::hashesValid() const
+{
+  return index && reinterpret_cast<const Header*>(index)->hashProbe == hashProbe();
+}
+
+QVector<KillRingStore::Slot> KillRingStore::committed() const
+{
+  QVector<Slot> result;
+  if (!index) {
+    return result;
+  }
+  const Header* header = reinterpret_cast<const Header*>(index);
+  const Slot* first = reinterpret_cast<const Slot*>(index + sizeof(Header));
+  for (quint32 i = 0; i < header->count; ++i) {
+    // an entry pointing outside the committed data is damaged
+    if (first[i].offset + first[i].size <= header->dataSize) {
+      result.append(first[i]);
+    }
+  }
+  return result;
+}
+
+/* Maps the data file up to at least end. Appends grow the file, the
+ * mapping is only renewed when a read needs the new part. */
+const char* KillRingStore::mapData(quint64 end) const
+{
+  if (data && qint64(end) <= dataMapped) {
+    return reinterpret_cast<const char*>(data);
+  }
+  if (data) {
+    dataFile.unmap(data);
+    data = 0;
+  }
+  dataMapped = dataFile.size();
+  if (qint64(end) > dataMapped || dataMapped == 0) {
+    return 0;
+  }
+  data = dataFile.map(0, dataMapped);
+  return reinterpret_cast<const char*>(data);
+}
+
+QString KillRingStore::read(const Slot& slot) const
+{
+  const char* bytes = mapData(slot.offset + slot.size);
+  if (!bytes) {
+    return QString();
+  }
+  // a damaged slot decodes to some other text, better none than garbage
+  if (qChecksum(bytes + slot.offset, slot.size) != slot.checksum) {
+    return QString();
+  }
+  const QString text = QString::fromUtf8(bytes + slot.offset, slot.size);
+  if (quint32(text.size()) != slot.length) {
+    return QString();
+  }
+  return text;
+}
+
+QString KillRingStore::readPrefix(const Slot& slot, int maxBytes) const
+{
+  if (slot.size <= quint32(maxBytes)) {
+    return read(slot);
+  }
+  const char* bytes = mapData(slot.offset + slot.size);
+  if (!bytes) {
+    return QString();
+  }
+  // the checksum needs all of the text, a prefix can only be too long
+  const QString text = QString::fromUtf8(bytes + slot.offset, maxBytes);
+  if (quint32(text.size()) > slot.length) {
+    return QString();
+  }
+  return text;
+}
+
+bool KillRingStore::append(const QString& text, Slot* slot)
+{
+  if (!index) {
+    return false;
+  }
+  // nobody else writes while the lock is held; if the files changed all
+  // the same, a lock removed by hand, do not write over the other's data
+  const Header* header = reinterpret_cast<const Header*>(index);
+  if (header->generation != generation || header->dataSize > quint64(dataEnd)) {
+    return false;
+  }
+  const QByteArray utf8 = text.toUtf8();
+  if (!dataFile.seek(dataEnd) || dataFile.write(utf8) != utf8.size()) {
+    return false;
+  }
+  slot->offset = dataEnd;
+  slot->size = utf8.size();
+  slot->length = text.size();
+  slot->hash = qHash(text);
+  slot->checksum = qChecksum(utf8.constData(), utf8.size());
+  dataEnd += utf8.size();
+  return true;
+}
+
+/* Commits the data written so far: the data on disk first, then the
+ * slots, then the header that makes them valid. */
+bool KillRingStore::writeIndex(const QVector<Slot>& entries)
+{
+  if (!index) {
+    return false;
+  }
+  if (!syncFile(dataFile)) {
+    return false;
+  }
+  Header* header = reinterpret_cast<Header*>(index);
+  const int count = qMin(entries.size(), int(MaxSlots));
+  Slot* first = reinterpret_cast<Slot*>(index + sizeof(Header));
+  std::memcpy(first, entries.constData(), count * sizeof(Slot));
+  const qint64 size = sizeof(Header) + qint64(MaxSlots) * sizeof(Slot);
+  if (!syncMap(indexFile, index, size)) {
+    return false;
+  }
+  header->dataSize = dataEnd;
+  header->count = count;
+  header->hashProbe = hashProbe();
+  return syncMap(indexFile, index, size);
+}
+
+qint64 KillRingStore::dataSize() const
+{
+  return dataEnd;
+}
+
+bool KillRingStore::compact(QVector<Slot>* entries)
+{
+  if (!index) {
+    return false;
+  }
+  const quint32 next = generation + 1;
+
+  QFile newData(dataFileName(next));
+  if (!newData.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    return false;
+  }
+  const char* bytes = mapData(dataEnd);
+  QVector<Slot> moved;
+  quint64 offset = 0;
+  foreach (Slot slot, *entries) {
+    if (!bytes || slot.offset + slot.size > quint64(dataEnd)
+        || newData.write(bytes + slot.offset, slot.size) != slot.size) {
+      newData.close();
+      newData.remove();
+      return false;
+    }
+    slot.offset = offset;
+    offset += slot.size;
+    moved.append(slot);
+  }
+  if (!syncFile(newData)) {
+    newData.close();
+    newData.remove();
+    return false;
+  }
+  newData.close();
+
+  // the new index goes to a temporary file and replaces the old one in
+  // one rename, a crash before that keeps the old generation
+  const QString tmpIndex = indexFileName() + QLatin1String(".tmp");
+  QFile newIndex(tmpIndex);
+  if (!newIndex.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+    QFile::remove(dataFileName(next));
+    return false;
+  }
+  QByteArray buffer(sizeof(Header) + MaxSlots * sizeof(Slot), 0);
+  Header* newHeader = reinterpret_cast<Header*>(buffer.data());
+  newHeader->magic = Magic;
+  newHeader->version = Version;
+  newHeader->generation = next;
+  newHeader->count = moved.size();
+  newHeader->dataSize = offset;
+  newHeader->hashProbe = hashProbe();
+  std::memcpy(buffer.data() + sizeof(Header), moved.constData(),
+              moved.size() * sizeof(Slot));
+  // on disk before the rename publishes it
+  const bool written = newIndex.write(buffer) == buffer.size() && syncFile(newIndex);
+  newIndex.close();
+
+  // the lock stays, no other process may see the files in between
+  closeFiles();
+  if (!written || !replaceFile(tmpIndex, indexFileName())) {
+    QFile::remove(tmpIndex);
+    QFile::remove(dataFileName(next));
+    openFiles();
+    return false;
+  }
+  // the rename reaches the disk before openFiles removes the old data
+  syncDirectory();
+  *entries = moved;
+  return openFiles();
+}
+
+void KillRingStore::removeStaleFiles()
+{
+  const Header* header = reinterpret_cast<const Header*>(index);
+  const QString current = QFileInfo(dataFileName(header->generation)).fileName();
+  QStringList filters;
+  filters << QLatin1String("killring-*.dat");
+  foreach (const QString& name, QDir(dir).entryList(filters, QDir::Files)) {
+    if (name != current) {
+      QFile::remove(dir + QLatin1Char('/') + name);
+    }
+  }
+}
+
+/* Written data on the disk, not just in the page cache */
+bool KillRingStore::syncFile(QFile& file)
+{
+  if (!file.flush()) {
+    return false;
+  }
+#ifdef Q_OS_WIN
+  return FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(file.handle())));
+#else
+  return fsync(file.handle()) == 0;
+#endif
+}
+
+bool KillRingStore::syncMap(QFile& file, uchar* map, qint64 size)
+{
+#ifdef Q_OS_WIN
+  return FlushViewOfFile(map, size)
+      && FlushFileBuffers(reinterpret_cast<HANDLE>(_get_osfhandle(file.handle())));
+#else
+  Q_UNUSED(file);
+  return msync(map, size, MS_SYNC) == 0;
+#endif
+}
+
+/* qHash changed between Qt versions, slot hashes written by another one
+ * do not match the texts any more */
+/* Makes a rename in the directory durable */
+void KillRingStore::syncDirectory() const
+{
+#ifndef Q_OS_WIN
+  const int fd = ::open(QFile::encodeName(dir).constData(), O_RDONLY);
+  if (fd >= 0) {
+    fsync(fd);
+    ::close(fd);
+  }
+#endif
+}
+
+quint32 KillRingStore::hashProbe()
+{
+  return qHash(QString::fromLatin1("EmacsKeys kill ring"));
+}
+
+bool KillRingStore::replaceFile(const QString& from, const QString& to)
+{
+  // rename() replaces atomically on POSIX, Windows needs the target gone
+  if (std::rename(QFile::encodeName(from).constData(),
+                  QFile::encodeName(to).constData()) == 0) {
+    return true;
+  }
+  QFile::remove(to);
+  return QFile::rename(from, to);
+}
@@ -0,0 +1,101 @@
+#ifndef KILLRINGSTORE_H
+#define KILLRINGSTORE_H
+
+#include <QFile>
+#include <QString>
+#include <QVector>
+
+/* On-disk kill ring, kept in a directory:
+ *  killring-<generation>.dat  append-only UTF-8 text of all entries
+ *  killring.idx               fixed size index, a header and one slot
+ *                             (offset, size, hash) per entry, newest first
+ * Both files are memory-mapped. A commit syncs the data to disk before
+ * the index that points into it, so not even a power loss leaves slots
+ * without their text. Text is only read when an entry is used,
+ * so opening costs the same for any amount of stored text. Data beyond
+ * the size committed in the index header is ignored, compaction writes a
+ * new generation and switches to it by renaming the index.
+ *
+ * One process at a time: open() locks killring.lock in the directory and
+ * holds the lock until close(), so appends, commits and compactions of another
+ * instance cannot interleave. When the lock is taken open() fails and the
+ * caller keeps its ring in memory. */
+class KillRingStore
+{
+public:
+  struct Slot
+  {
+    quint64 offset;
+    quint32 size;   // UTF-8 bytes in the data file
+    quint32 length; // QChars of the text
+    quint32 hash;     // qHash of the text, see hashesValid
+    quint32 checksum; // qChecksum of the UTF-8 bytes
+  };
+
+  enum { MaxSlots = 1024 };
+
+  KillRingStore();
+  ~KillRingStore();
+
+  bool open(const QString& directory);
+  void close();
+  bool isOpen() const;
+  // false when the slots' hashes were computed by a qHash that differs
+  // from this one, after an upgrade of Qt; the next writeIndex fixes that
+  bool hashesValid() const;
+
+  // committed entries, newest first
+  QVector<Slot> committed() const;
+  // null if the data does not match the slot
+  QString read(const Slot& slot) const;
+  // at most maxBytes from the start of the text, null if that cannot be
+  // part of the slot's text
+  QString readPrefix(const Slot& slot, int maxBytes) const;
+
+  // appends text to the data file, it is committed by the next writeIndex;
+  // slots given to writeIndex and compact carry hashes of this qHash
+  bool append(const QString& text, Slot* slot);
+  bool writeIndex(const QVector<Slot>& entries);
+
+  qint64 dataSize() const;
+  // copies the data of entries to a new generation, slots get new offsets
+  bool compact(QVector<Slot>* entries);
+
+private:
+  struct Header
+  {
+    quint32 magic;
+    quint32 version;
+    quint32 generation;
+    quint32 count;
+    quint64 dataSize; // committed length of the data file
+    quint32 hashProbe; // qHash of a fixed text by the Qt that wrote the slots
+    quint32 reserved;
+  };
+
+  QString dataFileName(quint32 number) const;
+  QString indexFileName() const;
+  bool lockDirectory();
+  bool openFiles();
+  void closeFiles();
+  bool mapIndex();
+  const char* mapData(quint64 end) const;
+  void removeStaleFiles();
+  static bool replaceFile(const QString& from, const QString& to);
+  static bool syncFile(QFile& file);
+  static bool syncMap(QFile& file, uchar* map, qint64 size);
+  void syncDirectory() const;
+  static quint32 hashProbe();
+
+  QString dir;
+  QFile lockFile; // open while the store is locked
+  QFile indexFile;
+  uchar* index;
+  mutable QFile dataFile;
+  mutable uchar* data;
+  mutable qint64 dataMapped;
+  qint64 dataEnd; // written, maybe not yet committed
+  quint32 generation; // of dataFile
+};
+
+#endif
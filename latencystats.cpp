@@ -0,0 +1,189 @@
+#include "latencystats.h"
+
+#include <QTextStream>
+
+#include <string.h>
+
+LatencyStats::LatencyStats()
+{
+  reset();
+}
+
+LatencyStats* LatencyStats::instance()
+{
+  static LatencyStats* instance;
+  if (!instance) {
+    instance = new LatencyStats();
+  }
+  return instance;
+}
+
+int LatencyStats::registerCommand(const char* name)
+{
+  const QByteArray key(name);
+  QHash<QByteArray, int>::const_iterator it = ids.constFind(key);
+  if (it != ids.constEnd()) {
+    return it.value();
+  }
+  if (names.count() == MaxCommands) {
+    return -1;
+  }
+  names.append(key);
+  ids.insert(key, names.count() - 1);
+  return names.count() - 1;
+}
+
+int LatencyStats::sizeClass(int lines)
+{
+  if (lines < 1000) {
+    return 0;
+  } else if (lines < 10000) {
+    return 1;
+  } else if (lines < 100000) {
+    return 2;
+  }
+  return 3;
+}
+
+void LatencyStats::reset()
+{
+  memset(buckets, 0, sizeof(buckets));
+}
+
+quint64 LatencyStats::count(int command, int sizeClass, int phase) const
+{
+  quint64 total = 0;
+  for (int b = 0; b < BucketCount; ++b) {
+    total += buckets[command][sizeClass][phase][b];
+  }
+  return total;
+}
+
+// upper bound of the bucket holding the p-th percentile, in microseconds
+qint64 LatencyStats::percentile(int command, int sizeClass, int phase,
+                                quint64 total, double p) const
+{
+  const quint64 rank = quint64(total * p + 0.5);
+  quint64 seen = 0;
+  for (int b = 0; b < BucketCount; ++b) {
+    seen += buckets[command][sizeClass][phase][b];
+    if (seen >= rank && seen > 0) {
+      return qint64(1) << b;
+    }
+  }
+  return qint64(1) << (BucketCount - 1);
+}
+
+const char* LatencyStats::phaseName(int phase)
+{
+  switch (phase) {
+  case HandleEvent:
+    return "handleEvent";
+  case SetTextCursor:
+    return "setTextCursor";
+  default:
+    return "paint";
+  }
+}
+
+const char* LatencyStats::sizeClassName(int sizeClass)
+{
+  static const char* const names[SizeClassCount] = {
+    "<1K", "<10K", "<100K", ">=100K"
+  };
+  return names[sizeClass];
+}
+
+QString LatencyStats::summary() const
+{
+  QString text;
+  QTextStream out(&text);
+  out << QString::fromLatin1("%1 %2 %3 %4 %5 %6\n")
+         .arg(QLatin1String("command"), -28)
+         .arg(QLatin1String("phase"), -14)
+         .arg(QLatin1String("lines"), -7)
+         .arg(QLatin1String("count"), 8)
+         .arg(QLatin1String("p50 us"), 8)
+         .arg(QLatin1String("p99 us"), 8);
+  for (int c = 0; c < names.count(); ++c) {
+    for (int s = 0; s < SizeClassCount; ++s) {
+      for (int p = 0; p < PhaseCount; ++p) {
+        const quint64 total = count(c, s, p);
+        if (!total) {
+          continue;
+        }
+        out << QString::fromLatin1("%1 %2 %3 %4 %5 %6\n")
+               .arg(QString::fromLatin1(names.at(c).constData()), -28)
+               .arg(QLatin1String(phaseName(p)), -14)
+               .arg(QLatin1String(sizeClassName(s)), -7)
+               .arg(total, 8)
+               .arg(percentile(c, s, p, total, 0.50), 8)
+               .arg(percentile(c, s, p, total, 0.99), 8);
+      }
+    }
+  }
+  return text;
+}
+
+/* One row per histogram, the bucket columns are named after their upper
+ * bound in microseconds. */
+void LatencyStats::writeCsv(QTextStream& out) const
+{
+  out << "command,phase,lines,count,p50_us,p99_us";
+  for (int b = 0; b < BucketCount; ++b) {
+    out << ",lt_" << (qint64(1) << b) << "us";
+  }
+  out << "\n";
+  for (int c = 0; c < names.count(); ++c) {
+    for (int s = 0; s < SizeClassCount; ++s) {
+      for (int p = 0; p < PhaseCount; ++p) {
+        const quint64 total = count(c, s, p);
+        if (!total) {
+          continue;
+        }
+        out << names.at(c).constData() << ',' << phaseName(p) << ','
+            << sizeClassName(s) << ',' << total << ','
+            << percentile(c, s, p, total, 0.50) << ','
+            << percentile(c, s, p, total, 0.99);
+        for (int b = 0; b < BucketCount; ++b) {
+          out << ',' << buckets[c][s][p][b];
+        }
+        out << "\n";
+      }
+    }
+  }
+}
+
+void LatencyStats::writeJson(QTextStream& out) const
+{
+  out << "{\n  \"bucketUpperBoundsUs\": [";
+  for (int b = 0; b < BucketCount; ++b) {
+    out << (b ? ", " : "") << (qint64(1) << b);
+  }
+  out << "],\n  \"histograms\": [";
+  bool first = true;
+  for (int c = 0; c < names.count(); ++c) {
+    for (int s = 0; s < SizeClassCount; ++s) {
+      for (int p = 0; p < PhaseCount; ++p) {
+        const quint64 total = count(c, s, p);
+        if (!total) {
+          continue;
+        }
+        out << (first ? "\n" : ",\n");
+        first = false;
+        out << "    {\"command\": \"" << names.at(c).constData()
+            << "\", \"phase\": \"" << phaseName(p)
+            << "\", \"lines\": \"" << sizeClassName(s)
+            << "\", \"count\": " << total
+            << ", \"p50Us\": " << percentile(c, s, p, total, 0.50)
+            << ", \"p99Us\": " << percentile(c, s, p, total, 0.99)
+            << ", \"buckets\": [";
+        for (int b = 0; b < BucketCount; ++b) {
+          out << (b ? ", " : "") << buckets[c][s][p][b];
+        }
+        out << "]}";
+      }
+    }
+  }
+  out << "\n  ]\n}\n";
+}
@@ -0,0 +1,74 @@
+#ifndef LATENCYSTATS_H
+#define LATENCYSTATS_H
+
+#include <QByteArray>
+#include <QHash>
+#include <QList>
+#include <QString>
+
+class QTextStream;
+
+/* Fixed-bucket latency histograms per command, document size and phase of
+ * the key handling. Recording is a couple of array increments, all memory
+ * is allocated up front. */
+class LatencyStats
+{
+public:
+  enum Phase
+  {
+    HandleEvent,   // running the command on the handler's cursor
+    SetTextCursor, // handing the cursor back to the editor
+    Paint,         // from the end of the key event to the paint it caused
+    PhaseCount
+  };
+
+  enum
+  {
+    MaxCommands = 64,
+    SizeClassCount = 4, // < 1K, < 10K, < 100K, >= 100K lines
+    BucketCount = 24    // bucket n holds [2^(n-1), 2^n) microseconds
+  };
+
+  static LatencyStats* instance();
+
+  // ids are shared by all handlers binding the same command name
+  int registerCommand(const char* name);
+
+  static int sizeClass(int lines);
+
+  void record(int command, Phase phase, int sizeClass, qint64 nsecs)
+  {
+    if (command >= 0)
+      ++buckets[command][sizeClass][phase][bucketFor(nsecs)];
+  }
+
+  void reset();
+  QString summary() const;
+  void writeCsv(QTextStream& out) const;
+  void writeJson(QTextStream& out) const;
+
+private:
+  LatencyStats();
+
+  static int bucketFor(qint64 nsecs)
+  {
+    qint64 usecs = nsecs / 1000;
+    int bucket = 0;
+    while (usecs && bucket < BucketCount - 1) {
+      usecs >>= 1;
+      ++bucket;
+    }
+    return bucket;
+  }
+
+  quint64 count(int command, int sizeClass, int phase) const;
+  qint64 percentile(int command, int sizeClass, int phase, quint64 total, double p) const;
+  static const char* phaseName(int phase);
+  static const char* sizeClassName(int sizeClass);
+
+  quint32 buckets[MaxCommands][SizeClassCount][PhaseCount][BucketCount];
+  QList<QByteArray> names;
+  QHash<QByteArray, int> ids;
+};
+
+#endif
@@ -4,11 +4,11 @@
 struct Mark 
 {
   Mark(int position)
-		: valid(true), active(true), position(position)
+		: valid(true), active(true), position(position), handle(-1)
   {
   }
   Mark()
-		: valid(false), active(false)
+		: valid(false), active(false), position(0), handle(-1)
   {
   }
   bool operator ==(const Mark& mark)
@@ -22,6 +22,7 @@ struct Mark
   bool valid;
 	bool active;
   int position;
+  int handle; // in the PositionTracker of the MarkRing
 };
 
 #endif
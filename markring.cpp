@@ -1,24 +1,31 @@
 #include "markring.h"
 #include "mark.h"
+#include "positiontracker.h"
 
 MarkRing::MarkRing()
-  : iter(ring.begin())
+  : positions(0), iter(ring.begin())
 {
 
 }
 
+void MarkRing::setPositions(PositionTracker* tracker)
+{
+  positions = tracker;
+}
+
 void MarkRing::addMark(int position)
 {
 	Mark mark(position); // will be valid and active
-	if (ring.isEmpty()) {
-    ring.prepend(mark);
-  }
-	if(ring.first() != mark) {
-		ring.first().active = false;
+	if(ring.isEmpty() || resolved(ring.first()) != mark) {
+		if (!ring.isEmpty()) {
+			ring.first().active = false;
+		}
+		mark.handle = positions->add(position);
 		ring.prepend(mark);
 	}
   // shrink ring to default emacs max size
   while (ring.count() > 16) {
+    positions->remove(ring.last().handle);
     ring.pop_back();
   }
   iter = ring.begin();
@@ -29,7 +36,7 @@ Mark MarkRing::getPreviousMark()
   if (ring.isEmpty()) {
     return Mark();
   }
-	Mark retval = *iter;
+	Mark retval = resolved(*iter);
 	if (++iter == ring.end()) {
     iter = ring.begin();
   }
@@ -38,7 +45,7 @@ Mark MarkRing::getPreviousMark()
 
 Mark MarkRing::getMostRecentMark()
 {
-  return ring.isEmpty() ? Mark() : ring.first();
+  return ring.isEmpty() ? Mark() : resolved(ring.first());
 }
 
 void MarkRing::toggleActive()
@@ -47,3 +54,11 @@ void MarkRing::toggleActive()
 		ring.first().active = not ring.first().active;
 	}
 }
+
+/* The mark with its current position in the document */
+Mark MarkRing::resolved(const Mark& mark) const
+{
+  Mark current(mark);
+  current.position = positions->position(mark.handle);
+  return current;
+}
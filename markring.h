@@ -5,16 +5,23 @@
 
 #include "mark.h"
 
+class PositionTracker;
+
 class MarkRing
 {
 public:
   MarkRing();
+  // keeps mark positions in tracker, which follows the document edits
+  void setPositions(PositionTracker* tracker);
   void addMark(int position);
   Mark getPreviousMark();
   Mark getMostRecentMark();
 	void toggleActive();
 
 private:
+  Mark resolved(const Mark& mark) const;
+
+  PositionTracker* positions;
   QList<Mark> ring;
   QList<Mark>::Iterator iter;
 };
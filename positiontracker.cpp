@@ -0,0 +1,130 @@
+#include "positiontracker.h"
+
+PositionTracker::PositionTracker(QObject* parent)
+  : QObject(parent), nextHandle(0)
+{
+}
+
+void PositionTracker::setDocument(QTextDocument* document)
+{
+  if (doc) {
+    disconnect(doc, 0, this, 0);
+  }
+  doc = document;
+  if (doc) {
+    connect(doc, SIGNAL(contentsChange(int,int,int)),
+        SLOT(contentsChange(int,int,int)));
+  }
+}
+
+QTextDocument* PositionTracker::document() const
+{
+  return doc;
+}
+
+int PositionTracker::add(int position)
+{
+  QVector<int> positions(base.size());
+  for (int i = 0; i < base.size(); ++i) {
+    positions[i] = positionAt(i);
+  }
+  const int rank = lowerBound(position);
+  positions.insert(rank, position);
+  const int handle = nextHandle++;
+  handles.insert(rank, handle);
+  rebuild(positions);
+  return handle;
+}
+
+void PositionTracker::remove(int handle)
+{
+  const QHash<int, int>::const_iterator it = ranks.constFind(handle);
+  if (it == ranks.constEnd()) {
+    return;
+  }
+  const int rank = it.value();
+  QVector<int> positions;
+  positions.reserve(base.size() - 1);
+  for (int i = 0; i < base.size(); ++i) {
+    if (i != rank) {
+      positions.append(positionAt(i));
+    }
+  }
+  handles.remove(rank);
+  rebuild(positions);
+}
+
+int PositionTracker::position(int handle) const
+{
+  const QHash<int, int>::const_iterator it = ranks.constFind(handle);
+  return it == ranks.constEnd() ? -1 : positionAt(it.value());
+}
+
+int PositionTracker::count() const
+{
+  return base.size();
+}
+
+void PositionTracker::contentsChange(int position, int removed, int added)
+{
+  const int end = position + removed;
+  // at the start of the change positions stay, inside it they are clamped
+  int rank = lowerBound(position + 1);
+  for (; rank < base.size(); ++rank) {
+    const int current = positionAt(rank);
+    if (current >= end) {
+      break;
+    }
+    const int moved = position + qMin(current - position, added);
+    if (moved != current) {
+      shift(rank, rank + 1, moved - current);
+    }
+  }
+  if (added != removed) {
+    shift(rank, base.size(), added - removed);
+  }
+}
+
+int PositionTracker::positionAt(int rank) const
+{
+  int sum = base.at(rank);
+  for (int i = rank + 1; i > 0; i -= i & -i) {
+    sum += tree.at(i);
+  }
+  return sum;
+}
+
+int PositionTracker::lowerBound(int position) const
+{
+  int low = 0;
+  int high = base.size();
+  while (low < high) {
+    const int middle = (low + high) / 2;
+    if (positionAt(middle) < position) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  return low;
+}
+
+void PositionTracker::shift(int from, int to, int delta)
+{
+  for (int i = from + 1; i < tree.size(); i += i & -i) {
+    tree[i] += delta;
+  }
+  for (int i = to + 1; i < tree.size(); i += i & -i) {
+    tree[i] -= delta;
+  }
+}
+
+void PositionTracker::rebuild(const QVector<int>& positions)
+{
+  base = positions;
+  tree.fill(0, base.size() + 1);
+  ranks.clear();
+  for (int i = 0; i < handles.size(); ++i) {
+    ranks.insert(handles.at(i), i);
+  }
+}
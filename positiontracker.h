@@ -0,0 +1,56 @@
+#ifndef POSITIONTRACKER_H
+#define POSITIONTRACKER_H
+
+#include <QHash>
+#include <QObject>
+#include <QPointer>
+#include <QTextDocument>
+#include <QVector>
+
+/* Document positions that follow edits, for marks, registers and the
+ * like. Positions are kept sorted by rank; a Fenwick tree over the ranks
+ * holds the shifts of all edits so far, so an edit adds its delta to the
+ * ranks behind it in O(log n) and only positions inside the changed range
+ * are touched one by one. Adding or removing a position renumbers the
+ * ranks, these are rare next to edits.
+ *
+ * Like Emacs markers a position at the start of an insertion stays in
+ * front of it. Positions inside replaced text keep their offset, clamped
+ * to the new text, so that format-only changes (removed == added) leave
+ * them alone. */
+class PositionTracker : public QObject
+{
+  Q_OBJECT
+
+public:
+  explicit PositionTracker(QObject* parent = 0);
+
+  // follows edits of document from now on, positions are kept
+  void setDocument(QTextDocument* document);
+  QTextDocument* document() const;
+
+  // starts tracking position and returns a handle for it
+  int add(int position);
+  void remove(int handle);
+  // current position of handle, -1 for an unknown handle
+  int position(int handle) const;
+  int count() const;
+
+private slots:
+  void contentsChange(int position, int removed, int added);
+
+private:
+  int positionAt(int rank) const;
+  int lowerBound(int position) const; // first rank at or after position
+  void shift(int from, int to, int delta); // ranks [from, to)
+  void rebuild(const QVector<int>& positions);
+
+  QPointer<QTextDocument> doc;
+  QVector<int> base;    // position per rank when the tree was last built
+  QVector<int> tree;    // Fenwick tree of shifts, 1-based
+  QVector<int> handles; // handle per rank
+  QHash<int, int> ranks; // handle -> rank
+  int nextHandle;
+};
+
+#endif // POSITIONTRACKER_H
@@ -0,0 +1,114 @@
+#include "registers.h"
+#include "documentstate.h"
+#include "killring.h"
+
+bool Registers::isValid(QChar name)
+{
+  return name.unicode() < Count;
+}
+
+Registers::Type Registers::type(QChar name) const
+{
+  return isValid(name) ? table[name.unicode()].type : Empty;
+}
+
+void Registers::setText(QChar name, const QString& text)
+{
+  Register& reg = reset(name);
+  reg.type = Text;
+  reg.text = KillRing::instance()->sharedText(text);
+}
+
+const QString& Registers::text(QChar name) const
+{
+  static const QString empty;
+  return type(name) == Text ? table[name.unicode()].text : empty;
+}
+
+void Registers::setRectangle(QChar name, const QStringList& lines)
+{
+  Register& reg = reset(name);
+  reg.type = Rectangle;
+  reg.rectangle = lines;
+}
+
+const QStringList& Registers::rectangle(QChar name) const
+{
+  static const QStringList empty;
+  return type(name) == Rectangle ? table[name.unicode()].rectangle : empty;
+}
+
+void Registers::setKilledRectangle(const QStringList& lines)
+{
+  killed = lines;
+}
+
+const QStringList& Registers::killedRectangle() const
+{
+  return killed;
+}
+
+void Registers::setPosition(QChar name, DocumentState* state, int position)
+{
+  Register& reg = reset(name);
+  reg.type = Position;
+  reg.state = state;
+  reg.handle = state->positions.add(position);
+}
+
+bool Registers::position(QChar name, GlobalMarkRing::Location* location) const
+{
+  if (type(name) != Position) {
+    return false;
+  }
+  const Register& reg = table[name.unicode()];
+  location->state = reg.state;
+  location->position = -1;
+  location->fileName = reg.fileName;
+  location->line = reg.line;
+  location->column = reg.column;
+  if (reg.state) {
+    location->position = reg.state->positions.position(reg.handle);
+    location->fileName = reg.state->fileName();
+    reg.state->lineAndColumn(location->position, &location->line, &location->column);
+  }
+  return true;
+}
+
+void Registers::documentClosed(DocumentState* state)
+{
+  for (int i = 0; i < Count; ++i) {
+    Register& reg = table[i];
+    if (reg.state != state) {
+      continue;
+    }
+    if (state->fileName().isEmpty() || !state->document()) {
+      reset(QChar(i));
+      continue;
+    }
+    state->lineAndColumn(state->positions.position(reg.handle), &reg.line, &reg.column);
+    reg.fileName = state->fileName();
+    reg.state = 0;
+    reg.handle = -1;
+  }
+}
+
+/* Empties the register, a position stops being tracked */
+Registers::Register& Registers::reset(QChar name)
+{
+  Register& reg = table[name.unicode()];
+  if (reg.state) {
+    reg.state->positions.remove(reg.handle);
+  }
+  reg = Register();
+  return reg;
+}
+
+Registers* Registers::instance()
+{
+  static Registers* instance;
+  if (!instance) {
+    instance = new Registers();
+  }
+  return instance;
+}
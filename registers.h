@@ -0,0 +1,61 @@
+#ifndef REGISTERS_H
+#define REGISTERS_H
+
+#include <QString>
+#include <QStringList>
+
+#include "globalmarkring.h"
+
+class DocumentState;
+
+/* Emacs registers, one slot per Latin-1 character, so a register is one
+ * array access. A text register holds the QString of the kill ring entry
+ * with the same text, if there is one, and the text is stored once.
+ * Position registers are handles into the PositionTracker of a
+ * DocumentState and follow edits; like global marks they turn into file
+ * name and line when the document closes. */
+class Registers
+{
+public:
+  enum Type { Empty, Text, Position, Rectangle };
+  enum { Count = 256 };
+
+  static bool isValid(QChar name);
+  Type type(QChar name) const;
+
+  void setText(QChar name, const QString& text);
+  const QString& text(QChar name) const;
+  // lines of the rectangle, top to bottom
+  void setRectangle(QChar name, const QStringList& lines);
+  const QStringList& rectangle(QChar name) const;
+  // the rectangle of the last C-x r k, for C-x r y
+  void setKilledRectangle(const QStringList& lines);
+  const QStringList& killedRectangle() const;
+  void setPosition(QChar name, DocumentState* state, int position);
+  // where a position register points, false for other registers
+  bool position(QChar name, GlobalMarkRing::Location* location) const;
+
+  void documentClosed(DocumentState* state);
+  static Registers* instance();
+
+private:
+  struct Register
+  {
+    Register() : type(Empty), state(0), handle(-1), line(0), column(0) {}
+    Type type;
+    QString text;
+    QStringList rectangle;
+    DocumentState* state; // position in an open document
+    int handle;
+    QString fileName;     // position in a closed one
+    int line;
+    int column;
+  };
+
+  Register& reset(QChar name);
+
+  Register table[Count];
+  QStringList killed;
+};
+
+#endif // REGISTERS_H
@@ -0,0 +1,205 @@
+#include "sharedkillring.h"
+
+#include <QAtomicInt>
+#include <QHash>
+#include <QThread>
+
+#include <cstring>
+
+static const quint32 Magic = 0x534b4b45; // "EKKS"
+static const quint32 Version = 1;
+
+struct SharedKillRing::Header
+{
+  quint32 magic;
+  quint32 version;
+  QAtomicInt sequence; // odd while a writer changes the segment
+  quint32 count;       // table in use, newest first
+  quint32 serial;      // serial of the newest entry
+  quint32 writePos;    // next free byte in the data area
+};
+
+struct SharedKillRing::Slot
+{
+  quint32 offset;
+  quint32 bytes;
+  quint32 hash;
+  quint32 serial;
+};
+
+SharedKillRing::SharedKillRing()
+  : memory(0)
+{
+}
+
+SharedKillRing::~SharedKillRing()
+{
+  detach();
+}
+
+SharedKillRing::Header* SharedKillRing::header()
+{
+  return static_cast<Header*>(memory->data());
+}
+
+SharedKillRing::Slot* SharedKillRing::slotArray()
+{
+  return reinterpret_cast<Slot*>(static_cast<char*>(memory->data()) + sizeof(Header));
+}
+
+char* SharedKillRing::dataArea()
+{
+  return reinterpret_cast<char*>(slotArray() + MaxSlots);
+}
+
+bool SharedKillRing::attach(const QString& key)
+{
+  detach();
+  memory = new QSharedMemory(key);
+  const int size = sizeof(Header) + MaxSlots * sizeof(Slot) + DataBytes;
+  if (!memory->create(size)) {
+    if (memory->error() != QSharedMemory::AlreadyExists || !memory->attach()) {
+      detach();
+      return false;
+    }
+  }
+  if (memory->size() < size || !memory->lock()) {
+    detach();
+    return false;
+  }
+  if (header()->magic != Magic || header()->version != Version) {
+    initialize();
+  }
+  memory->unlock();
+  return true;
+}
+
+// called with the lock held
+void SharedKillRing::initialize()
+{
+  std::memset(memory->data(), 0, sizeof(Header) + MaxSlots * sizeof(Slot));
+  Header* h = header();
+  h->sequence = 0;
+  h->version = Version;
+  h->magic = Magic;
+}
+
+void SharedKillRing::detach()
+{
+  if (memory) {
+    memory->detach();
+    delete memory;
+    memory = 0;
+  }
+}
+
+bool SharedKillRing::isAttached() const
+{
+  return memory != 0;
+}
+
+quint32 SharedKillRing::add(const QString& text)
+{
+  const quint32 bytes = text.size() * sizeof(QChar);
+  if (!memory || bytes == 0 || bytes > quint32(DataBytes) || !memory->lock()) {
+    return 0;
+  }
+  Header* h = header();
+  Slot* table = slotArray();
+  // a writer that died mid-write left the sequence odd
+  if (int(h->sequence) & 1) {
+    h->sequence.fetchAndAddOrdered(1);
+  }
+  h->sequence.fetchAndAddOrdered(1);
+
+  quint32 pos = h->writePos;
+  if (pos + bytes > quint32(DataBytes)) {
+    pos = 0;
+  }
+  const uint hash = qHash(text);
+  // drop entries whose text gets overwritten and an equal older entry
+  quint32 kept = 0;
+  for (quint32 i = 0; i < h->count; ++i) {
+    const Slot& slot = table[i];
+    const bool overwritten = slot.offset < pos + bytes && pos < slot.offset + slot.bytes;
+    const bool duplicate = slot.hash == hash && slot.bytes == bytes
+        && std::memcmp(dataArea() + slot.offset, text.constData(), bytes) == 0;
+    if (!overwritten && !duplicate) {
+      table[kept++] = slot;
+    }
+  }
+  kept = qMin(kept, quint32(MaxSlots - 1));
+  std::memmove(table + 1, table, kept * sizeof(Slot));
+  std::memcpy(dataArea() + pos, text.constData(), bytes);
+  table[0].offset = pos;
+  table[0].bytes = bytes;
+  table[0].hash = hash;
+  table[0].serial = ++h->serial;
+  h->count = kept + 1;
+  h->writePos = pos + bytes;
+  const quint32 serial = h->serial;
+
+  h->sequence.fetchAndAddOrdered(1);
+  memory->unlock();
+  return serial;
+}
+
+/* One optimistic copy, false when a writer was active meanwhile */
+bool SharedKillRing::readItems(quint32 serial, QList<Item>* items)
+{
+  Header* h = header();
+  const int before = h->sequence.fetchAndAddAcquire(0);
+  if (before & 1) {
+    return false;
+  }
+  items->clear();
+  const quint32 count = qMin(h->count, quint32(MaxSlots));
+  const Slot* table = slotArray();
+  for (quint32 i = 0; i < count; ++i) {
+    const Slot slot = table[i];
+    if (slot.serial <= serial) {
+      break; // newest first, the rest is older
+    }
+    if (slot.offset + slot.bytes > quint32(DataBytes)) {
+      return false;
+    }
+    Item item;
+    item.serial = slot.serial;
+    item.text = QString(reinterpret_cast<const QChar*>(dataArea() + slot.offset),
+                        slot.bytes / sizeof(QChar));
+    items->prepend(item);
+  }
+  return h->sequence.fetchAndAddOrdered(0) == before;
+}
+
+QList<SharedKillRing::Item> SharedKillRing::itemsSince(quint32 serial)
+{
+  QList<Item> items;
+  if (!memory) {
+    return items;
+  }
+  for (int attempt = 0; attempt < 16; ++attempt) {
+    if (readItems(serial, &items)) {
+      return items;
+    }
+    QThread::yieldCurrentThread();
+  }
+  // writers keep us out, wait for the lock like they do
+  if (memory->lock()) {
+    Header* h = header();
+    if (int(h->sequence) & 1) {
+      h->sequence.fetchAndAddOrdered(1);
+    }
+    readItems(serial, &items);
+    memory->unlock();
+  }
+  return items;
+}
+
+quint32 SharedKillRing::lastSerial()
+{
+  if (!memory) {
+    return 0;
+  }
+  return header()->serial;
+}
@@ -0,0 +1,51 @@
+#ifndef SHAREDKILLRING_H
+#define SHAREDKILLRING_H
+
+#include <QList>
+#include <QSharedMemory>
+#include <QString>
+
+/* Kill ring entries in a QSharedMemory segment, so that all processes
+ * attached with the same key see one history. Writers serialize with the
+ * segment lock. The header carries a sequence counter that is odd while
+ * a write is in progress, readers copy without the lock and retry when
+ * the counter moved (a seqlock). Text lives in a circular data area,
+ * entries whose text was overwritten drop out. */
+class SharedKillRing
+{
+public:
+  struct Item
+  {
+    QString text;
+    quint32 serial; // increases with every add in any process
+  };
+
+  enum { MaxSlots = 256, DataBytes = 8 * 1024 * 1024 };
+
+  SharedKillRing();
+  ~SharedKillRing();
+
+  bool attach(const QString& key);
+  void detach();
+  bool isAttached() const;
+
+  // adds text as the newest entry and returns its serial, 0 on failure
+  quint32 add(const QString& text);
+  // entries added after serial, oldest first
+  QList<Item> itemsSince(quint32 serial);
+  quint32 lastSerial();
+
+private:
+  struct Header;
+  struct Slot;
+
+  Header* header();
+  Slot* slotArray();
+  char* dataArea();
+  void initialize();
+  bool readItems(quint32 serial, QList<Item>* items);
+
+  QSharedMemory* memory;
+};
+
+#endif